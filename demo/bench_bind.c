@@ -0,0 +1,85 @@
+// Copyright (c) 2021 Ryosuke Saito All rights reserved.
+// MIT licensed
+
+/*
+  Measure the round-trip latency of messages between two loopback endpoints
+  bound with rteipc_bind() and with rteipc_bind_sync().
+
+  $ ./bench_bind 100000
+  rteipc_bind:      1.28 usec/round trip
+  rteipc_bind_sync: 1.12 usec/round trip
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "rteipc.h"
+
+
+static struct event_base *base;
+static int count, remaining;
+static struct timespec start, end;
+
+static void echo_cb(const char *name, void *data, size_t len, void *arg)
+{
+	rteipc_xfer("echo", data, len);
+}
+
+static void ping_cb(const char *name, void *data, size_t len, void *arg)
+{
+	if (--remaining > 0) {
+		rteipc_xfer("ping", data, len);
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	event_base_loopbreak(base);
+}
+
+static void start_cb(evutil_socket_t fd, short what, void *arg)
+{
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rteipc_xfer("ping", "ping", 4);
+}
+
+static void run(const char *label, int (*bind)(int, int))
+{
+	double usec;
+	int ping, echo;
+
+	ping = rteipc_open("ping");
+	echo = rteipc_open("echo");
+	if (ping < 0 || echo < 0 || bind(ping, echo)) {
+		fprintf(stderr, "Failed to set up endpoints\n");
+		exit(1);
+	}
+	rteipc_xfer_setcb("ping", ping_cb, NULL);
+	rteipc_xfer_setcb("echo", echo_cb, NULL);
+
+	remaining = count;
+	event_base_once(base, -1, EV_TIMEOUT, start_cb, NULL, NULL);
+	rteipc_dispatch(NULL);
+
+	usec = (end.tv_sec - start.tv_sec) * 1e6 +
+		(end.tv_nsec - start.tv_nsec) / 1e3;
+	printf("%-18s%.2f usec/round trip\n", label, usec / count);
+
+	rteipc_close(ping);
+	rteipc_close(echo);
+}
+
+int main(int argc, char **argv)
+{
+	count = (argc > 1) ? atoi(argv[1]) : 100000;
+	if (count <= 0) {
+		fprintf(stderr, "Usage: %s [count]\n", argv[0]);
+		return 1;
+	}
+
+	base = event_base_new();
+	rteipc_init(base);
+	run("rteipc_bind:", rteipc_bind);
+	run("rteipc_bind_sync:", rteipc_bind_sync);
+	rteipc_shutdown();
+	return 0;
+}
@@ -1,14 +1,66 @@
 // Copyright (c) 2018 Ryosuke Saito All rights reserved.
 // MIT licensed
 
+#define _GNU_SOURCE
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
 #include <sys/time.h>
 #include <event2/event.h>
 
 
 __thread struct event_base *__base;
 
+/* Counts messages delivered to endpoints and processes on this thread */
+__thread unsigned long __activity;
+
+/* Spin window of rteipc_dispatch() in usec, 0 if busy-poll is disabled */
+static __thread unsigned int busypoll_usec;
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool loop_done(int ret)
+{
+	return ret || event_base_got_exit(__base) ||
+		event_base_got_break(__base);
+}
+
+/*
+ * Block until something happens, then keep polling without sleeping while
+ * messages are delivered, so the next one is handled without the wakeup
+ * latency of epoll_wait(). Back to blocking after busypoll_usec of silence.
+ */
+static void busypoll_dispatch(void)
+{
+	unsigned long seen;
+	uint64_t last;
+
+	for (;;) {
+		if (loop_done(event_base_loop(__base, EVLOOP_ONCE)))
+			return;
+
+		last = now_usec();
+		while (now_usec() - last < busypoll_usec) {
+			seen = __activity;
+			if (loop_done(event_base_loop(__base, EVLOOP_NONBLOCK)))
+				return;
+			if (__activity != seen)
+				last = now_usec();
+		}
+	}
+}
+
 void rteipc_dispatch(struct timeval *tv)
 {
 	if (!__base)
@@ -16,7 +68,47 @@ void rteipc_dispatch(struct timeval *tv)
 
 	if (tv)
 		event_base_loopexit(__base, tv);
-	event_base_dispatch(__base);
+
+	if (busypoll_usec)
+		busypoll_dispatch();
+	else
+		event_base_dispatch(__base);
+}
+
+void rteipc_set_busypoll(unsigned int usec)
+{
+	busypoll_usec = usec;
+}
+
+int rteipc_set_sched(int cpu, int priority)
+{
+	struct sched_param sp;
+	cpu_set_t set;
+	int err;
+
+	if (cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (err) {
+			fprintf(stderr, "Failed to set affinity to CPU%d: %s\n",
+					cpu, strerror(err));
+			return -1;
+		}
+	}
+
+	if (priority > 0) {
+		memset(&sp, 0, sizeof(sp));
+		sp.sched_priority = priority;
+		err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+		if (err) {
+			fprintf(stderr, "Failed to set SCHED_FIFO priority %d: %s\n",
+					priority, strerror(err));
+			return -1;
+		}
+	}
+
+	return 0;
 }
 
 void rteipc_reinit(void)
@@ -4,8 +4,10 @@
 #include <string.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/eventfd.h>
 #include <arpa/inet.h>
 #include <event2/bufferevent.h>
 #include <event2/buffer.h>
@@ -17,18 +19,32 @@
 #include "message.h"
 #include "table.h"
 #include "ep.h"
+#include "shm.h"
 
 
 #define MAX_NR_CN		(MAX_NR_EP * 2)
 
 extern __thread struct event_base *__base;
+extern __thread unsigned long __activity;
+
+/* Connection to SHM endpoint */
+struct shm_conn {
+	struct shm_chan ch;
+	bool attached;        /* ch received from the endpoint */
+	evutil_socket_t sock;
+	struct event *sock_ev;
+	struct event *wake;   /* woken up by the endpoint */
+	struct evbuffer *pending; /* messages waiting for space in the ring */
+};
 
 struct rteipc_ctx {
 	struct bufferevent *bev;
+	struct shm_conn *shm; /* NULL unless connected to SHM endpoint */
 	rteipc_read_cb read_cb;
 	rteipc_err_cb err_cb;
 	void *arg;
 	short flag;
+	unsigned int proto;   /* defined by the library on top, e.g. rtemgr */
 };
 
 static dtbl_t ctx_tbl = DTBL_INITIALIZER(MAX_NR_CN);
@@ -90,13 +106,197 @@ static void connect_read_cb(struct bufferevent *bev, void *arg)
 		if (ctx->read_cb)
 			ctx->read_cb(id, msg, len, ctx->arg);
 		free(msg);
+		__activity++;
+
+	}
+
+out:
+	pthread_mutex_unlock(&ctx_mutex);
+}
+
+static void shm_conn_free(struct shm_conn *conn)
+{
+	if (conn->wake)
+		event_free(conn->wake);
+	event_free(conn->sock_ev);
+	evutil_closesocket(conn->sock);
+	if (conn->attached)
+		shm_chan_destroy(&conn->ch);
+	evbuffer_free(conn->pending);
+	free(conn);
+}
+
+/* Same as connect_event_cb() for the connection to SHM endpoint */
+static void shm_conn_close(int id, short events)
+{
+	struct rteipc_ctx *ctx = dtbl_get(&ctx_tbl, id);
+
+	dtbl_del(&ctx_tbl, id);
+	shm_conn_free(ctx->shm);
+	if (ctx->err_cb)
+		ctx->err_cb(id, events, ctx->arg);
+	free(ctx);
+	event_base_loopbreak(__base);
+}
+
+static void shm_conn_flush(struct shm_conn *conn)
+{
+	int ret;
+
+	while ((ret = shm_chan_send_msg(&conn->ch, conn->pending))) {
+		if (ret < 0)
+			fprintf(stderr, "Message too long for shm ring\n");
+	}
+}
+
+static void shm_wake_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct rteipc_ctx *ctx;
+	int id = (intptr_t)arg;
+	eventfd_t val;
+	size_t len;
+	void *msg;
+	int ret;
+
+	pthread_mutex_lock(&ctx_mutex);
 
+	ctx = dtbl_get(&ctx_tbl, id);
+	eventfd_read(fd, &val);
+
+	/* messages are passed to read_cb in place in the ring */
+	do {
+		while ((ret = shm_chan_recv(&ctx->shm->ch, &msg, &len)) > 0) {
+			if (ctx->read_cb)
+				ctx->read_cb(id, msg, len, ctx->arg);
+			shm_chan_release(&ctx->shm->ch);
+			__activity++;
+		}
+		if (ret < 0) {
+			fprintf(stderr, "shm ring corrupted\n");
+			shm_conn_close(id, BEV_EVENT_ERROR);
+			goto out;
+		}
+	} while (!shm_chan_idle(&ctx->shm->ch));
+
+	/* the endpoint may have made space for messages pending */
+	shm_conn_flush(ctx->shm);
+
+out:
+	pthread_mutex_unlock(&ctx_mutex);
+}
+
+static void shm_sock_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct rteipc_ctx *ctx;
+	struct shm_conn *conn;
+	int id = (intptr_t)arg;
+	int ret;
+	char c;
+
+	pthread_mutex_lock(&ctx_mutex);
+
+	ctx = dtbl_get(&ctx_tbl, id);
+	conn = ctx->shm;
+
+	/* nothing but the channel is sent over the socket */
+	if (conn->attached) {
+		if (recv(fd, &c, 1, 0) <= 0)
+			shm_conn_close(id, BEV_EVENT_EOF);
+		goto out;
 	}
 
+	if ((ret = shm_chan_recv_fds(&conn->ch, fd)) > 0)
+		goto out;
+
+	if (ret < 0) {
+		shm_conn_close(id, BEV_EVENT_ERROR);
+		goto out;
+	}
+
+	conn->attached = true;
+	conn->wake = event_new(__base, conn->ch.efd, EV_READ | EV_PERSIST,
+			       shm_wake_cb, arg);
+	if (!conn->wake) {
+		fprintf(stderr, "Failed to create shm event\n");
+		shm_conn_close(id, BEV_EVENT_ERROR);
+		goto out;
+	}
+	event_add(conn->wake, NULL);
+	/* take messages sent before we get ready */
+	event_active(conn->wake, EV_READ, 0);
+	shm_conn_flush(conn);
+
 out:
 	pthread_mutex_unlock(&ctx_mutex);
 }
 
+/**
+ * Send a message to SHM endpoint, or keep it until the ring is received or
+ * has space. Either @data or @buf is given.
+ */
+static int shm_conn_send(struct shm_conn *conn, const void *data,
+		struct evbuffer *buf, size_t len)
+{
+	ev_uint32_t nl = htonl(len);
+	int ret;
+
+	if (conn->attached && !evbuffer_get_length(conn->pending)) {
+		if (buf)
+			data = evbuffer_pullup(buf, len);
+		ret = shm_chan_send(&conn->ch, data, len);
+		if (ret < 0) {
+			fprintf(stderr, "Message too long for shm ring\n");
+			return -1;
+		}
+		if (ret) {
+			if (buf)
+				evbuffer_drain(buf, len);
+			return 0;
+		}
+	}
+
+	evbuffer_add(conn->pending, &nl, 4);
+	if (buf)
+		return evbuffer_add_buffer(conn->pending, buf);
+	return evbuffer_add(conn->pending, data, len);
+}
+
+/**
+ * Connect to SHM endpoint. The channel is received asynchronously, messages
+ * sent before that are kept in conn->pending.
+ */
+static int shm_connect(struct rteipc_ctx *ctx, struct sockaddr *addr,
+		int addrlen)
+{
+	struct shm_conn *conn;
+
+	conn = malloc(sizeof(*conn));
+	if (!conn)
+		return -1;
+
+	memset(conn, 0, sizeof(*conn));
+	conn->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (conn->sock < 0)
+		goto free_conn;
+
+	if (connect(conn->sock, addr, addrlen) < 0 ||
+			evutil_make_socket_nonblocking(conn->sock) < 0)
+		goto close_sock;
+
+	conn->pending = evbuffer_new();
+	if (!conn->pending)
+		goto close_sock;
+
+	ctx->shm = conn;
+	return 0;
+
+close_sock:
+	evutil_closesocket(conn->sock);
+free_conn:
+	free(conn);
+	return -1;
+}
+
 int rteipc_setcb(int id, rteipc_read_cb read_cb, rteipc_err_cb err_cb,
 			void *arg, short flag)
 {
@@ -116,12 +316,44 @@ int rteipc_setcb(int id, rteipc_read_cb read_cb, rteipc_err_cb err_cb,
 	ctx->err_cb = err_cb;
 	ctx->arg = arg;
 	ctx->flag = flag;
+	ctx->proto = 0;
 
 out:
 	pthread_mutex_unlock(&ctx_mutex);
 	return ret;
 }
 
+/**
+ * rteipc_set_proto - set the protocol spoken over the connection
+ * @id: context id
+ * @proto: value defined by the user, 0 by default
+ *
+ * The value lives as long as the connection, and is cleared by
+ * rteipc_setcb(). It can be set from a read callback.
+ */
+int rteipc_set_proto(int id, unsigned int proto)
+{
+	struct rteipc_ctx *ctx = dtbl_get(&ctx_tbl, id);
+
+	if (!ctx) {
+		fprintf(stderr, "Invalid connection id:%d\n", id);
+		return -1;
+	}
+	ctx->proto = proto;
+	return 0;
+}
+
+/**
+ * rteipc_get_proto - return the protocol set by rteipc_set_proto(), or 0
+ * @id: context id
+ */
+unsigned int rteipc_get_proto(int id)
+{
+	struct rteipc_ctx *ctx = dtbl_get(&ctx_tbl, id);
+
+	return ctx ? ctx->proto : 0;
+}
+
 /**
  * rteipc_send - generic function to send data to an endpoint
  * @id: context id
@@ -136,6 +368,8 @@ int rteipc_send(int id, const void *data, size_t len)
 		fprintf(stderr, "Invalid connection id:%d\n", id);
 		return -1;
 	}
+	if (ctx->shm)
+		return shm_conn_send(ctx->shm, data, NULL, len);
 	return rteipc_buffer(ctx->bev, data, len);
 }
 
@@ -153,6 +387,9 @@ int rteipc_evsend(int id, struct evbuffer *buf)
 		fprintf(stderr, "Invalid connection id:%d\n", id);
 		return -1;
 	}
+	if (ctx->shm)
+		return shm_conn_send(ctx->shm, NULL, buf,
+				     evbuffer_get_length(buf));
 	return rteipc_evbuffer(ctx->bev, buf);
 }
 
@@ -249,7 +486,7 @@ int rteipc_sysfs_send(int id, const char *attr, const char *val)
 int rteipc_connect(const char *uri)
 {
 	struct rteipc_ctx *ctx;
-	struct bufferevent *bev;
+	struct bufferevent *bev = NULL;
 	struct sockaddr *addr;
 	struct sockaddr_un sun;
 	struct sockaddr_in sin;
@@ -261,15 +498,19 @@ int rteipc_connect(const char *uri)
 
 	sscanf(uri, "%[^:]://%99[^\n]", protocol, path);
 
-	if (strcmp(protocol, "ipc") && strcmp(protocol, "inet")) {
+	if (strcmp(protocol, "ipc") && strcmp(protocol, "inet") &&
+			strcmp(protocol, "shm")) {
 		fprintf(stderr, "We cannot connect to '%s' endpoint\n", protocol);
 		return -1;
 	}
 
-	bev = bufferevent_socket_new(__base, -1, BEV_OPT_CLOSE_ON_FREE);
-	if (!bev) {
-		fprintf(stderr, "Failed to create socket\n");
-		return -1;
+	/* the connection to SHM endpoint has no bufferevent */
+	if (strcmp(protocol, "shm")) {
+		bev = bufferevent_socket_new(__base, -1, BEV_OPT_CLOSE_ON_FREE);
+		if (!bev) {
+			fprintf(stderr, "Failed to create socket\n");
+			return -1;
+		}
 	}
 
 	ctx = malloc(sizeof(*ctx));
@@ -278,6 +519,7 @@ int rteipc_connect(const char *uri)
 			"Failed to allocate memory to create connection\n");
 		goto free_bev;
 	}
+	memset(ctx, 0, sizeof(*ctx));
 
 	if (!strcmp(protocol, "inet")) {
 		memset(&sin, 0, sizeof(sin));
@@ -313,6 +555,13 @@ int rteipc_connect(const char *uri)
 		addr = (struct sockaddr *)&sun;
 	}
 
+	if (!bev) {
+		if (shm_connect(ctx, addr, addrlen)) {
+			fprintf(stderr, "Failed to connect to %s\n", uri);
+			goto free_ctx;
+		}
+	}
+
 	pthread_mutex_lock(&ctx_mutex);
 
 	id = dtbl_set(&ctx_tbl, ctx);
@@ -321,6 +570,20 @@ int rteipc_connect(const char *uri)
 		goto free_ctx;
 	}
 
+	if (ctx->shm) {
+		ctx->shm->sock_ev = event_new(__base, ctx->shm->sock,
+				EV_READ | EV_PERSIST, shm_sock_cb,
+				(void *)(intptr_t)id);
+		if (!ctx->shm->sock_ev) {
+			dtbl_del(&ctx_tbl, id);
+			pthread_mutex_unlock(&ctx_mutex);
+			goto free_ctx;
+		}
+		event_add(ctx->shm->sock_ev, NULL);
+		pthread_mutex_unlock(&ctx_mutex);
+		return id;
+	}
+
 	ctx->bev = bev;
 	bufferevent_setcb(bev, connect_read_cb, NULL,
 				connect_event_cb, (void *)(intptr_t)id);
@@ -342,8 +605,14 @@ int rteipc_connect(const char *uri)
 	return id;
 
 free_ctx:
+	if (ctx->shm) {
+		evutil_closesocket(ctx->shm->sock);
+		evbuffer_free(ctx->shm->pending);
+		free(ctx->shm);
+	}
 	free(ctx);
 free_bev:
-	bufferevent_free(bev);
+	if (bev)
+		bufferevent_free(bev);
 	return -1;
 }
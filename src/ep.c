@@ -7,6 +7,8 @@
 #include "ep.h"
 
 
+extern __thread unsigned long __activity;
+
 struct ep_to_str {
 	int type;
 	char *name;
@@ -20,6 +22,8 @@ static const struct ep_to_str name_tbl[] = {
 	{EP_I2C,      "I2C"},
 	{EP_SYSFS,    "SYSFS"},
 	{EP_INET,     "INET"},
+	{EP_IIO,      "IIO"},
+	{EP_SHM,      "SHM"},
 };
 
 static inline const char *type_to_str(int type)
@@ -35,11 +39,16 @@ static inline const char *type_to_str(int type)
 static void read_cb(struct bufferevent *bev, void *arg)
 {
 	struct rteipc_ep *ep = arg;
-	if (ep && ep->ops->on_data)
+
+	__activity++;
+	if (ep && ep->ops->on_data) {
+		ep->busy++;
 		ep->ops->on_data(ep, bev);
+		ep->busy--;
+	}
 }
 
-int rteipc_bind(int lh, int rh)
+static int do_bind(int lh, int rh, bool sync)
 {
 	struct rteipc_ep *le, *re;
 
@@ -59,7 +68,17 @@ int rteipc_bind(int lh, int rh)
 		return -1;
 	}
 
-	return bind_endpoint(le, re, read_cb, NULL, NULL);
+	return bind_endpoint(le, re, read_cb, NULL, NULL, sync);
+}
+
+int rteipc_bind(int lh, int rh)
+{
+	return do_bind(lh, rh, false);
+}
+
+int rteipc_bind_sync(int lh, int rh)
+{
+	return do_bind(lh, rh, true);
 }
 
 void rteipc_unbind(int id)
@@ -73,6 +92,25 @@ void rteipc_unbind(int id)
 	unbind_endpoint(ep);
 }
 
+int rteipc_hup_setcb(int id, rteipc_hup_cb cb, void *arg)
+{
+	struct rteipc_ep *ep;
+
+	if (!(ep = find_endpoint(id))) {
+		fprintf(stderr, "Invalid endpoint specified\n");
+		return -1;
+	}
+
+	if (ep->type != EP_IPC && ep->type != EP_INET && ep->type != EP_SHM) {
+		fprintf(stderr, "Endpoint has no process connected\n");
+		return -1;
+	}
+
+	ep->hup_cb = cb;
+	ep->hup_arg = arg;
+	return 0;
+}
+
 int rteipc_open(const char *uri)
 {
 	char protocol[16] = {0}, path[128] = {0};
@@ -99,6 +137,10 @@ int rteipc_open(const char *uri)
 		type = EP_I2C;
 	} else if (!strcmp(protocol, "sysfs")) {
 		type = EP_SYSFS;
+	} else if (!strcmp(protocol, "iio")) {
+		type = EP_IIO;
+	} else if (!strcmp(protocol, "shm")) {
+		type = EP_SHM;
 	} else {
 		fprintf(stderr, "Unknown protocol:%s\n", protocol);
 		return -1;
@@ -36,10 +36,11 @@
 #ifndef _RTEIPC_EP_H
 #define _RTEIPC_EP_H
 
+#include <stdbool.h>
 #include <event2/event.h>
 #include <event2/bufferevent.h>
 
-#define MAX_NR_EP		(2 * DESC_BIT_WIDTH)
+#define MAX_NR_EP		(16 * DESC_BIT_WIDTH)
 
 #define EP_TEMPLATE	0
 #define EP_IPC		1
@@ -50,14 +51,17 @@
 #define EP_SYSFS	6
 #define EP_INET		7  /* EP_INET is implemented as an EP_IPC extention */
 #define EP_LOOP		8
+#define EP_IIO		9
+#define EP_SHM		10  /* EP_SHM is an EP_IPC over shared memory */
 
 #define COMPAT_ANY		(~0)
-#define COMPAT_IPC		((1 << EP_IPC)|(1 << EP_INET))
+#define COMPAT_IPC		((1 << EP_IPC)|(1 << EP_INET)|(1 << EP_SHM))
 #define COMPAT_TTY		(1 << EP_TTY)
 #define COMPAT_GPIO		(1 << EP_GPIO)
 #define COMPAT_SPI		(1 << EP_SPI)
 #define COMPAT_I2C		(1 << EP_I2C)
 #define COMPAT_SYSFS		(1 << EP_SYSFS)
+#define COMPAT_IIO		(1 << EP_IIO)
 
 #define COMPATIBLE_WITH(name, mask)                   \
 	static inline int name##_compatible(int val)  \
@@ -80,6 +84,10 @@ struct rteipc_ep {
 	struct bufferevent *bev;
 	struct rteipc_ep_ops *ops;
 	void *data;
+	bool sync;  /* on_data is called as soon as the partner writes */
+	int busy;   /* nesting level of on_data */
+	void (*hup_cb)(int ep, void *arg);  /* the process has disconnected */
+	void *hup_arg;
 };
 
 int register_endpoint(struct rteipc_ep *ep);
@@ -88,7 +96,11 @@ void unregister_endpoint(struct rteipc_ep *ep);
 
 int bind_endpoint(struct rteipc_ep *lh, struct rteipc_ep *rh,
 	bufferevent_data_cb readcb, bufferevent_data_cb writecb,
-	bufferevent_event_cb eventcb);
+	bufferevent_event_cb eventcb, bool sync);
+
+void deliver_endpoint(struct bufferevent *bev);
+
+void hangup_endpoint(struct rteipc_ep *ep);
 
 void unbind_endpoint(struct rteipc_ep *ep);
 
@@ -9,6 +9,7 @@
 #include <signal.h>
 #include <errno.h>
 #include <limits.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <event2/bufferevent.h>
@@ -18,6 +19,7 @@
 #include <event2/event.h>
 #include <event2/thread.h>
 #include <gpiod.h>
+#include "rteipc.h"
 #include "ep.h"
 #include "message.h"
 
@@ -34,30 +36,289 @@
  *     arg1 - GPIO value, 1(assert) or 0(deassert)
  *     arg2 - time of event occurrence (sec)
  *     arg3 - time of event occurrence (nsec)
+ *
+ *   (Only for gpio-in direction with 'ts=ns' option)
+ *   Output { uint8_t, uint8_t, uint64_t, uint64_t }
+ *     arg1 - GPIO value, 1(assert) or 0(deassert)
+ *     arg2 - clock of timestamps, RTEIPC_CLOCK_{MONOTONIC,REALTIME,HTE}
+ *     arg3 - time of event occurrence (nsec)
+ *     arg4 - time the event is sent out by the endpoint (nsec)
+ *
+ *   arg4 - arg3 is the latency inside rteipc, and the time of the reader
+ *   callback - arg3 is the end-to-end latency when read with the same clock.
+ *   For HTE, arg4 is taken from CLOCK_MONOTONIC.
+ *
+ * Options (only for gpio-in direction):
+ *   debounce=usec
+ *     Report a new value only after the line has been stable for 'usec'
+ *     microseconds. Edges in between are absorbed by the endpoint.
+ *   coalesce=usec
+ *     Report at most one value per 'usec' microseconds, that is the latest
+ *     state of the line at the end of the window. Nothing is reported if the
+ *     line went back to the last reported state within the window.
+ *
+ *   The two options are exclusive. In both cases, the timestamp of the
+ *   reported value is the time of the last edge observed.
+ *
+ *   clock={monotonic|realtime|hte}
+ *     Clock used for event timestamps (default monotonic). Only monotonic
+ *     is available with libgpiod v1.
+ *   ts={timespec|ns}
+ *     Output format of timestamps (default timespec), see above.
+ *
+ *   When built against libgpiod v2 (RTEIPC_LIBGPIOD_V2), debounce is done
+ *   by the kernel and edge events are read in batches.
  */
 
+/* Max number of edge events read at once */
+#define GPIO_EVENT_BATCH	16
+
 struct gpio_data {
 	struct gpiod_chip *chip;
+#ifdef RTEIPC_LIBGPIOD_V2
+	struct gpiod_line_request *req;
+	struct gpiod_edge_event_buffer *events;
+	unsigned int offset;
+	unsigned long seqno;  /* line sequence number of the last event */
+#else
 	struct gpiod_line *line;
+#endif
 	int out;
 	struct event *ev;
+	struct evbuffer *buf;
+	unsigned long debounce_us;
+	unsigned long coalesce_us;
+	struct event *timer;
+	int last;            /* value last sent upstream, -1 if unknown */
+	int latest;          /* value of the latest edge */
+	struct timespec ts;  /* time of the latest edge */
+	uint8_t clock;       /* RTEIPC_CLOCK_* */
+	int ts_ns;           /* if output timestamps in nsec */
 };
 
+static void gpio_send(struct rteipc_ep *self, uint8_t value,
+			const struct timespec *ts)
+{
+	struct gpio_data *data = self->data;
+	struct evbuffer *buf = data->buf;
+	struct timespec now;
+	uint64_t event_ns, sent_ns;
+	size_t nl;
+
+	if (data->ts_ns) {
+		event_ns = ts->tv_sec * 1000000000ull + ts->tv_nsec;
+		clock_gettime(data->clock == RTEIPC_CLOCK_REALTIME ?
+				CLOCK_REALTIME : CLOCK_MONOTONIC, &now);
+		sent_ns = now.tv_sec * 1000000000ull + now.tv_nsec;
+		evbuffer_add(buf, &value, sizeof(value));        /* arg1 */
+		evbuffer_add(buf, &data->clock, sizeof(data->clock)); /* arg2 */
+		evbuffer_add(buf, &event_ns, sizeof(event_ns));  /* arg3 */
+		evbuffer_add(buf, &sent_ns, sizeof(sent_ns));    /* arg4 */
+	} else {
+		evbuffer_add(buf, &value, sizeof(value));              /* arg1 */
+		evbuffer_add(buf, &ts->tv_sec, sizeof(ts->tv_sec));    /* arg2 */
+		evbuffer_add(buf, &ts->tv_nsec, sizeof(ts->tv_nsec));  /* arg3 */
+	}
+	nl = htonl(evbuffer_get_length(buf));
+	evbuffer_prepend(buf, &nl, 4);
+	bufferevent_write_buffer(self->bev, buf);
+	deliver_endpoint(self->bev);
+	data->last = value;
+}
+
+/**
+ * Timer callback for debounce and coalesce, report the latest state if it
+ * differs from the one reported last.
+ */
+static void settle(evutil_socket_t fd, short what, void *arg)
+{
+	struct rteipc_ep *self = arg;
+	struct gpio_data *data = self->data;
+
+	if (!self->bev || data->latest == data->last)
+		return;
+
+	gpio_send(self, data->latest, &data->ts);
+}
+
+static void handle_edge(struct rteipc_ep *self, uint8_t value,
+			const struct timespec *ts)
+{
+	struct gpio_data *data = self->data;
+	struct timeval tv;
+
+	if (!data->debounce_us && !data->coalesce_us) {
+		gpio_send(self, value, ts);
+		return;
+	}
+
+	data->latest = value;
+	data->ts = *ts;
+
+	if (data->debounce_us) {
+		/* restart the settle time on every edge */
+		tv.tv_sec = data->debounce_us / 1000000;
+		tv.tv_usec = data->debounce_us % 1000000;
+		evtimer_add(data->timer, &tv);
+	} else if (!evtimer_pending(data->timer, NULL)) {
+		/* open a new window, later edges just update the state */
+		tv.tv_sec = data->coalesce_us / 1000000;
+		tv.tv_usec = data->coalesce_us % 1000000;
+		evtimer_add(data->timer, &tv);
+	}
+}
+
 /**
  * GPIO event handling
  */
+#ifdef RTEIPC_LIBGPIOD_V2
+static void upstream(evutil_socket_t fd, short what, void *arg)
+{
+	struct rteipc_ep *self = arg;
+	struct gpio_data *data = self->data;
+	struct gpiod_edge_event *ev;
+	struct timespec ts;
+	unsigned long seqno;
+	uint64_t ns;
+	uint8_t value;
+	int i, n;
+
+	n = gpiod_line_request_read_edge_events(data->req, data->events,
+			GPIO_EVENT_BATCH);
+	if (n < 0) {
+		fprintf(stderr, "Error reading gpio event\n");
+		event_del(data->ev);
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		ev = gpiod_edge_event_buffer_get_event(data->events, i);
+
+		/* the kernel drops events when its fifo overflows */
+		seqno = gpiod_edge_event_get_line_seqno(ev);
+		if (data->seqno && seqno != data->seqno + 1)
+			fprintf(stderr, "Lost %lu gpio events\n",
+					seqno - data->seqno - 1);
+		data->seqno = seqno;
+
+		/* discard the event if it's not bound yet */
+		if (!self->bev)
+			continue;
+
+		value = (gpiod_edge_event_get_event_type(ev) ==
+				GPIOD_EDGE_EVENT_RISING_EDGE ? 1 : 0);
+		ns = gpiod_edge_event_get_timestamp_ns(ev);
+		ts.tv_sec = ns / 1000000000;
+		ts.tv_nsec = ns % 1000000000;
+		handle_edge(self, value, &ts);
+	}
+}
+
+static inline void line_set_value(struct gpio_data *data, uint8_t value)
+{
+	gpiod_line_request_set_value(data->req, data->offset,
+			value ? GPIOD_LINE_VALUE_ACTIVE :
+				GPIOD_LINE_VALUE_INACTIVE);
+}
+
+static inline int line_get_value(struct gpio_data *data)
+{
+	return gpiod_line_request_get_value(data->req, data->offset);
+}
+
+/**
+ * Request the line with a single line request. For the input direction,
+ * 'debounce_us' is handed over to the kernel and cleared.
+ */
+static int line_request(struct gpio_data *data, const char *consumer,
+			unsigned int offset, int val)
+{
+	struct gpiod_line_settings *settings;
+	struct gpiod_line_config *line_cfg = NULL;
+	struct gpiod_request_config *req_cfg = NULL;
+	int ret = -1;
+
+	data->offset = offset;
+
+	if (!(settings = gpiod_line_settings_new()) ||
+			!(line_cfg = gpiod_line_config_new()) ||
+			!(req_cfg = gpiod_request_config_new()))
+		goto out;
+
+	if (data->out) {
+		gpiod_line_settings_set_direction(settings,
+				GPIOD_LINE_DIRECTION_OUTPUT);
+		gpiod_line_settings_set_output_value(settings,
+				val ? GPIOD_LINE_VALUE_ACTIVE :
+				      GPIOD_LINE_VALUE_INACTIVE);
+	} else {
+		gpiod_line_settings_set_direction(settings,
+				GPIOD_LINE_DIRECTION_INPUT);
+		gpiod_line_settings_set_edge_detection(settings,
+				GPIOD_LINE_EDGE_BOTH);
+		gpiod_line_settings_set_debounce_period_us(settings,
+				data->debounce_us);
+		if (gpiod_line_settings_set_event_clock(settings,
+				data->clock == RTEIPC_CLOCK_REALTIME ?
+					GPIOD_LINE_CLOCK_REALTIME :
+				data->clock == RTEIPC_CLOCK_HTE ?
+					GPIOD_LINE_CLOCK_HTE :
+					GPIOD_LINE_CLOCK_MONOTONIC))
+			goto out;
+		data->debounce_us = 0;  /* debounced by the kernel */
+		gpiod_request_config_set_event_buffer_size(req_cfg,
+				GPIO_EVENT_BATCH);
+	}
+
+	if (gpiod_line_config_add_line_settings(line_cfg, &offset, 1,
+				settings))
+		goto out;
+
+	gpiod_request_config_set_consumer(req_cfg, consumer);
+	data->req = gpiod_chip_request_lines(data->chip, req_cfg, line_cfg);
+	if (!data->req)
+		goto out;
+
+	if (!data->out) {
+		data->events = gpiod_edge_event_buffer_new(GPIO_EVENT_BATCH);
+		if (!data->events) {
+			gpiod_line_request_release(data->req);
+			data->req = NULL;
+			goto out;
+		}
+	}
+	ret = 0;
+out:
+	gpiod_request_config_free(req_cfg);
+	gpiod_line_config_free(line_cfg);
+	gpiod_line_settings_free(settings);
+	return ret;
+}
+
+static inline int line_get_fd(struct gpio_data *data)
+{
+	return gpiod_line_request_get_fd(data->req);
+}
+
+static inline void line_release(struct gpio_data *data)
+{
+	if (data->events)
+		gpiod_edge_event_buffer_free(data->events);
+	if (data->req)
+		gpiod_line_request_release(data->req);
+}
+#else
 static void upstream(evutil_socket_t fd, short what, void *arg)
 {
 	struct rteipc_ep *self = arg;
 	struct gpio_data *data = self->data;
 	struct gpiod_line_event ev;
-	struct evbuffer *buf = evbuffer_new();
-	size_t nl;
 	uint8_t value;
 
 	if (gpiod_line_event_read(data->line, &ev) < 0) {
 		fprintf(stderr, "Error reading gpio event\n");
-		goto err;
+		event_del(data->ev);
+		return;
 	}
 
 	/* discard the event if it's not bound yet */
@@ -65,17 +326,48 @@ static void upstream(evutil_socket_t fd, short what, void *arg)
 		return;
 
 	value = (ev.event_type == GPIOD_LINE_EVENT_RISING_EDGE ? 1 : 0);
-	evbuffer_add(buf, &value, sizeof(value));                  /* arg1 */
-	evbuffer_add(buf, &ev.ts.tv_sec, sizeof(ev.ts.tv_sec));    /* arg2 */
-	evbuffer_add(buf, &ev.ts.tv_nsec, sizeof(ev.ts.tv_nsec));  /* arg3 */
-	nl = htonl(evbuffer_get_length(buf));
-	evbuffer_prepend(buf, &nl, 4);
-	bufferevent_write_buffer(self->bev, buf);
-	return;
-err:
-	event_del(data->ev);
-	return;
+	handle_edge(self, value, &ev.ts);
+}
+
+static inline void line_set_value(struct gpio_data *data, uint8_t value)
+{
+	gpiod_line_set_value(data->line, value);
+}
+
+static inline int line_get_value(struct gpio_data *data)
+{
+	return gpiod_line_get_value(data->line);
+}
+
+static int line_request(struct gpio_data *data, const char *consumer,
+			unsigned int offset, int val)
+{
+	/* the kernel stamps v1 events with CLOCK_MONOTONIC */
+	if (data->clock != RTEIPC_CLOCK_MONOTONIC) {
+		fprintf(stderr, "Only monotonic clock is supported\n");
+		return -1;
+	}
+
+	data->line = gpiod_chip_get_line(data->chip, offset);
+	if (!data->line)
+		return -1;
+
+	if (data->out)
+		return gpiod_line_request_output(data->line, consumer, val);
+
+	return gpiod_line_request_both_edges_events(data->line, consumer);
+}
+
+static inline int line_get_fd(struct gpio_data *data)
+{
+	return gpiod_line_event_get_fd(data->line);
+}
+
+static inline void line_release(struct gpio_data *data)
+{
+	/* lines are released along with the chip */
 }
+#endif /* RTEIPC_LIBGPIOD_V2 */
 
 static void gpio_on_data(struct rteipc_ep *self, struct bufferevent *bev)
 {
@@ -107,26 +399,74 @@ static void gpio_on_data(struct rteipc_ep *self, struct bufferevent *bev)
 			goto free_msg;
 		}
 
-		gpiod_line_set_value(data->line, value);
+		line_set_value(data, value);
 free_msg:
 		free(msg);
 	}
 }
 
+static int parse_opts(struct gpio_data *data, char *opts)
+{
+	char *key, *val, *save = NULL;
+
+	for (key = strtok_r(opts, ",", &save); key;
+			key = strtok_r(NULL, ",", &save)) {
+		if ((val = strchr(key, '=')))
+			*val++ = '\0';
+
+		if (!strcmp(key, "debounce") && val) {
+			data->debounce_us = strtoul(val, NULL, 0);
+		} else if (!strcmp(key, "coalesce") && val) {
+			data->coalesce_us = strtoul(val, NULL, 0);
+		} else if (!strcmp(key, "clock") && val) {
+			if (!strcmp(val, "monotonic")) {
+				data->clock = RTEIPC_CLOCK_MONOTONIC;
+			} else if (!strcmp(val, "realtime")) {
+				data->clock = RTEIPC_CLOCK_REALTIME;
+			} else if (!strcmp(val, "hte")) {
+				data->clock = RTEIPC_CLOCK_HTE;
+			} else {
+				fprintf(stderr, "Invalid gpio clock:%s\n", val);
+				return -1;
+			}
+		} else if (!strcmp(key, "ts") && val) {
+			if (!strcmp(val, "ns")) {
+				data->ts_ns = 1;
+			} else if (strcmp(val, "timespec")) {
+				fprintf(stderr, "Invalid gpio ts:%s\n", val);
+				return -1;
+			}
+		} else {
+			fprintf(stderr, "Invalid gpio option:%s\n", key);
+			return -1;
+		}
+	}
+
+	if (data->debounce_us && data->coalesce_us) {
+		fprintf(stderr, "debounce and coalesce are exclusive\n");
+		return -1;
+	}
+	return 0;
+}
+
 static int gpio_open(struct rteipc_ep *self, const char *path)
 {
 	struct gpiod_chip *chip;
-	struct gpiod_line *line;
 	struct gpio_data *data;
 	struct event *ev;
 	char consumer[256] = {0};
 	char chip_path[PATH_MAX] = {0};
 	char dir[4] = {0};
+	char opts[128] = {0};
 	int val = 0;
-	int num = 0, fd, ret;
+	int num = 0, fd;
 
-	sscanf(path, "%[^@]@%[^-]-%d,%[^,],%d",
-			consumer, chip_path, &num, dir, &val);
+	/*
+	 * path is "consumer@chip-num,in[,options...]" or
+	 * "consumer@chip-num,out,val"
+	 */
+	sscanf(path, "%[^@]@%[^-]-%d,%3[^,],%127[^\n]",
+			consumer, chip_path, &num, dir, opts);
 
 	data = malloc(sizeof(*data));
 	if (!data) {
@@ -135,6 +475,18 @@ static int gpio_open(struct rteipc_ep *self, const char *path)
 	}
 
 	memset(data, 0, sizeof(*data));
+	data->last = data->latest = -1;
+
+	if (strlen(dir) == 3 && !strncasecmp(dir, "out", 3)) {
+		data->out = 1;
+		val = strtol(opts, NULL, 0);
+	} else if (strlen(dir) == 2 && !strncasecmp(dir, "in", 2)) {
+		if (parse_opts(data, opts))
+			goto free_data;
+	} else {
+		fprintf(stderr, "Invalid path:%s\n", path);
+		goto free_data;
+	}
 
 	chip = gpiod_chip_open(chip_path);
 	if (!chip) {
@@ -143,45 +495,48 @@ static int gpio_open(struct rteipc_ep *self, const char *path)
 	}
 	data->chip = chip;
 
-	line = gpiod_chip_get_line(chip, num);
-	if (!line) {
-		fprintf(stderr, "Failed to get num=%d of %s\n",
-				num, chip_path);
+	if (line_request(data, consumer, num, val) < 0) {
+		fprintf(stderr, "Failed to request num=%d of %s as %s\n",
+				num, chip_path, data->out ? "output" : "input");
 		goto free_chip;
 	}
-	data->line = line;
 
-	if (strlen(dir) == 3 && !strncasecmp(dir, "out", 3)) {
-		data->out = 1;
-		ret = gpiod_line_request_output(line, consumer, val);
-		if (ret < 0) {
-			fprintf(stderr, "Failed to request gpio output\n");
-			goto free_chip;
-		}
-	} else if (strlen(dir) == 2 && !strncasecmp(dir, "in", 2)) {
-		ret  = gpiod_line_request_both_edges_events(line, consumer);
-		if (ret < 0) {
-			fprintf(stderr, "Failed to request gpio events\n");
-			goto free_chip;
-		}
-		fd = gpiod_line_event_get_fd(line);
+	if (!data->out) {
+		fd = line_get_fd(data);
 		if (fd < 0) {
 			fprintf(stderr, "Failed to get gpio event fd\n");
-			goto free_chip;
+			goto free_line;
+		}
+		data->buf = evbuffer_new();
+		if (!data->buf) {
+			fprintf(stderr, "Failed to allocate gpio buffer\n");
+			goto free_line;
+		}
+		if (data->debounce_us || data->coalesce_us) {
+			data->timer = evtimer_new(self->base, settle, self);
+			if (!data->timer) {
+				fprintf(stderr, "Failed to create gpio timer\n");
+				goto free_buf;
+			}
+			/* the initial state is the reference for the first edge */
+			data->last = data->latest = line_get_value(data);
 		}
 		ev = event_new(self->base, fd, EV_READ | EV_PERSIST,
 			       upstream, self);
 		data->ev = ev;
-		event_add(ev, NULL);
-	} else {
-		fprintf(stderr, "Invalid path:%s\n", path);
-		goto free_chip;
 	}
 
+	/* Set data first, the event may fire in another thread at once */
 	self->data = data;
+	if (data->ev)
+		event_add(data->ev, NULL);
 
 	return 0;
 
+free_buf:
+	evbuffer_free(data->buf);
+free_line:
+	line_release(data);
 free_chip:
 	gpiod_chip_close(chip);
 free_data:
@@ -193,7 +548,12 @@ static void gpio_close(struct rteipc_ep *self)
 {
 	struct gpio_data *data = self->data;
 	if (data->ev)
-		event_del(data->ev);
+		event_free(data->ev);
+	if (data->timer)
+		event_free(data->timer);
+	if (data->buf)
+		evbuffer_free(data->buf);
+	line_release(data);
 	gpiod_chip_close(data->chip);
 	free(data);
 }
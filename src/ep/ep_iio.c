@@ -0,0 +1,442 @@
+// Copyright (c) 2021 Ryosuke Saito All rights reserved.
+// MIT licensed
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <event2/bufferevent.h>
+#include <event2/buffer.h>
+#include <event2/util.h>
+#include <event2/event.h>
+#include "ep.h"
+#include "message.h"
+
+/**
+ * IIO endpoint
+ *
+ * Streams samples captured by an IIO device through its buffer
+ * (/dev/iio:deviceN). The path is a device as 'iio:deviceN', '/dev/iio:deviceN'
+ * or the name of the device (e.g. 'iio_dummy_part_no'), followed by options.
+ *
+ * Data format:
+ *   Input  { none }
+ *
+ *   Output { uint8_t[] }
+ *     arg1 - 'block' scans as laid out in the IIO buffer, i.e. enabled scan
+ *            elements ordered by their index, each aligned to its storage
+ *            size (see '*_index' and '*_type' in scan_elements of the
+ *            device)
+ *
+ * Options:
+ *   channels=name[+name...]
+ *     Scan elements to be enabled, by the prefix of '*_en' file (e.g.
+ *     'in_voltage0+in_voltage1+in_timestamp'). All are enabled by default.
+ *   trigger=name
+ *     Trigger set to trigger/current_trigger.
+ *   length=scans
+ *     Length of the kernel buffer set to buffer/length.
+ *   block=scans
+ *     Scans sent out in one message (default 16). It's also set to
+ *     buffer/watermark so that the endpoint wakes up once per block.
+ */
+
+#define IIO_SYSFS_DIR		"/sys/bus/iio/devices"
+#define IIO_BLOCK_DEFAULT	16
+#define IIO_MAX_CHANNELS	64
+
+struct iio_data {
+	int fd;
+	struct event *ev;
+	char dir[PATH_MAX];   /* sysfs directory of the device */
+	size_t scan_size;     /* bytes per scan */
+	size_t block;         /* scans per message */
+	struct evbuffer *rx;
+	struct evbuffer *out;
+};
+
+static int iio_write_attr(struct iio_data *data, const char *attr,
+		const char *val)
+{
+	char path[PATH_MAX];
+	int fd, ret;
+
+	snprintf(path, sizeof(path), "%s/%s", data->dir, attr);
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	ret = write(fd, val, strlen(val));
+	close(fd);
+	return (ret < 0) ? -1 : 0;
+}
+
+static int iio_read_attr(struct iio_data *data, const char *attr,
+		char *buf, size_t size)
+{
+	char path[PATH_MAX];
+	ssize_t ret;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", data->dir, attr);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	ret = read(fd, buf, size - 1);
+	close(fd);
+	if (ret < 0)
+		return -1;
+
+	while (ret > 0 && buf[ret - 1] == '\n')
+		ret--;
+	buf[ret] = '\0';
+	return 0;
+}
+
+/**
+ * Find the sysfs directory of an IIO device given as 'iio:deviceN',
+ * '/dev/iio:deviceN' or its name.
+ */
+static int iio_find_device(struct iio_data *data, const char *dev)
+{
+	char name[NAME_MAX + 1];
+	struct dirent *ent;
+	DIR *dir;
+
+	if (!strncmp(dev, "/dev/", 5))
+		dev += 5;
+
+	if (!strncmp(dev, "iio:device", 10)) {
+		snprintf(data->dir, sizeof(data->dir), "%s/%s",
+				IIO_SYSFS_DIR, dev);
+		return access(data->dir, F_OK);
+	}
+
+	if (!(dir = opendir(IIO_SYSFS_DIR)))
+		return -1;
+
+	while ((ent = readdir(dir))) {
+		if (strncmp(ent->d_name, "iio:device", 10))
+			continue;
+		snprintf(data->dir, sizeof(data->dir), "%s/%s",
+				IIO_SYSFS_DIR, ent->d_name);
+		if (!iio_read_attr(data, "name", name, sizeof(name)) &&
+				!strcmp(name, dev)) {
+			closedir(dir);
+			return 0;
+		}
+	}
+	closedir(dir);
+	return -1;
+}
+
+static bool channel_selected(const char *channels, const char *name)
+{
+	const char *p = channels;
+	size_t len = strlen(name);
+
+	if (!channels)
+		return true;
+
+	while (p && *p) {
+		if (!strncmp(p, name, len) && (p[len] == '+' || !p[len]))
+			return true;
+		if ((p = strchr(p, '+')))
+			p++;
+	}
+	return false;
+}
+
+static int cmp_index(const void *a, const void *b)
+{
+	const int *l = a, *r = b;
+	return l[0] - r[0];
+}
+
+/**
+ * Enable scan elements selected by @channels, disable the others and compute
+ * the size of a scan in the same way as the kernel does.
+ */
+static int iio_setup_scan(struct iio_data *data, const char *channels)
+{
+	int chan[IIO_MAX_CHANNELS][2];  /* { index, bytes } */
+	unsigned int bits, storage, repeat;
+	char attr[PATH_MAX], buf[64], *x;
+	size_t size = 0, largest = 0, len;
+	struct dirent *ent;
+	int i, nr = 0;
+	DIR *dir;
+
+	snprintf(attr, sizeof(attr), "%s/scan_elements", data->dir);
+	if (!(dir = opendir(attr))) {
+		fprintf(stderr, "No scan elements in %s\n", data->dir);
+		return -1;
+	}
+
+	while ((ent = readdir(dir))) {
+		len = strlen(ent->d_name);
+		if (len < 4 || strcmp(ent->d_name + len - 3, "_en"))
+			continue;
+
+		ent->d_name[len - 3] = '\0';
+		snprintf(attr, sizeof(attr), "scan_elements/%s_en",
+				ent->d_name);
+		if (!channel_selected(channels, ent->d_name)) {
+			iio_write_attr(data, attr, "0");
+			continue;
+		}
+
+		if (nr == IIO_MAX_CHANNELS || iio_write_attr(data, attr, "1")) {
+			fprintf(stderr, "Failed to enable %s\n", ent->d_name);
+			goto close_dir;
+		}
+
+		snprintf(attr, sizeof(attr), "scan_elements/%s_index",
+				ent->d_name);
+		if (iio_read_attr(data, attr, buf, sizeof(buf)))
+			goto invalid;
+		chan[nr][0] = strtol(buf, NULL, 0);
+
+		/* e.g. 'le:s12/16>>4' or 'le:s16/16X2>>0' */
+		snprintf(attr, sizeof(attr), "scan_elements/%s_type",
+				ent->d_name);
+		if (iio_read_attr(data, attr, buf, sizeof(buf)) ||
+				sscanf(buf, "%*[^:]:%*c%u/%u", &bits, &storage) != 2)
+			goto invalid;
+		repeat = (x = strchr(buf, 'X')) ? strtoul(x + 1, NULL, 0) : 1;
+		chan[nr][1] = storage / 8 * (repeat ?: 1);
+		nr++;
+	}
+	closedir(dir);
+
+	if (!nr) {
+		fprintf(stderr, "No scan element enabled\n");
+		return -1;
+	}
+
+	qsort(chan, nr, sizeof(chan[0]), cmp_index);
+	for (i = 0; i < nr; i++) {
+		len = chan[i][1];
+		size = (size + len - 1) / len * len + len;
+		if (len > largest)
+			largest = len;
+	}
+	data->scan_size = (size + largest - 1) / largest * largest;
+	return 0;
+
+invalid:
+	fprintf(stderr, "Invalid scan element %s\n", ent->d_name);
+close_dir:
+	closedir(dir);
+	return -1;
+}
+
+static void upstream(evutil_socket_t fd, short what, void *arg)
+{
+	struct rteipc_ep *self = arg;
+	struct iio_data *data = self->data;
+	size_t frame = data->scan_size * data->block;
+	struct evbuffer_iovec v;
+	ssize_t ret;
+
+	/*
+	 * Read into a single contiguous extent of a whole block. The IIO
+	 * buffer returns whole scans only, and fails with EINVAL if a vector
+	 * is shorter than a scan, so the scattered read of evbuffer_read()
+	 * cannot be used.
+	 */
+	if (evbuffer_reserve_space(data->rx, frame, &v, 1) < 1) {
+		fprintf(stderr, "Failed to reserve iio buffer\n");
+		return;
+	}
+
+	do {
+		ret = read(fd, v.iov_base, frame);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret <= 0) {
+		if (ret < 0 && errno == EAGAIN)
+			return;
+		if (ret < 0 && errno != ENODEV) {
+			fprintf(stderr, "Failed to read iio buffer(%d)\n", errno);
+			return;
+		}
+		/* the device is gone, stop reading rather than spinning */
+		fprintf(stderr, "iio device removed\n");
+		event_del(data->ev);
+		return;
+	}
+
+	v.iov_len = ret;
+	evbuffer_commit_space(data->rx, &v, 1);
+
+	/* discard data if it's not bound yet */
+	if (!self->bev) {
+		evbuffer_drain(data->rx, evbuffer_get_length(data->rx));
+		return;
+	}
+
+	while (evbuffer_get_length(data->rx) >= frame) {
+		evbuffer_remove_buffer(data->rx, data->out, frame);
+		rteipc_evbuffer(self->bev, data->out);
+	}
+}
+
+static void iio_on_data(struct rteipc_ep *self, struct bufferevent *bev)
+{
+	struct evbuffer *in = bufferevent_get_input(bev);
+
+	/* nothing can be written to the IIO endpoint */
+	evbuffer_drain(in, evbuffer_get_length(in));
+}
+
+static int parse_opts(char *opts, char **channels, char **trigger,
+		size_t *length, size_t *block)
+{
+	char *key, *val, *save;
+
+	for (key = strtok_r(opts, ",", &save); key;
+			key = strtok_r(NULL, ",", &save)) {
+		if ((val = strchr(key, '=')))
+			*val++ = '\0';
+
+		if (!strcmp(key, "channels") && val) {
+			*channels = val;
+		} else if (!strcmp(key, "trigger") && val) {
+			*trigger = val;
+		} else if (!strcmp(key, "length") && val) {
+			*length = strtoul(val, NULL, 0);
+		} else if (!strcmp(key, "block") && val) {
+			*block = strtoul(val, NULL, 0);
+		} else {
+			fprintf(stderr, "Invalid iio option:%s\n", key);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int iio_open(struct rteipc_ep *self, const char *path)
+{
+	struct iio_data *data;
+	char dev[128] = {0}, opts[256] = {0}, node[PATH_MAX], num[32];
+	char *channels = NULL, *trigger = NULL;
+	size_t length = 0, block = IIO_BLOCK_DEFAULT;
+	int fd;
+
+	sscanf(path, "%127[^,],%255[^\n]", dev, opts);
+
+	if (parse_opts(opts, &channels, &trigger, &length, &block))
+		return -1;
+
+	if (!block) {
+		fprintf(stderr, "Invalid iio block size\n");
+		return -1;
+	}
+
+	data = malloc(sizeof(*data));
+	if (!data) {
+		fprintf(stderr, "Failed to allocate memory for ep_iio\n");
+		return -1;
+	}
+	memset(data, 0, sizeof(*data));
+	data->block = block;
+
+	if (iio_find_device(data, dev)) {
+		fprintf(stderr, "Failed to find iio device(%s)\n", dev);
+		goto free_data;
+	}
+
+	/* the buffer must be disabled while configuring */
+	iio_write_attr(data, "buffer/enable", "0");
+
+	if (iio_setup_scan(data, channels))
+		goto free_data;
+
+	if (trigger && iio_write_attr(data, "trigger/current_trigger",
+				trigger)) {
+		fprintf(stderr, "Failed to set iio trigger(%s)\n", trigger);
+		goto free_data;
+	}
+
+	if (length) {
+		snprintf(num, sizeof(num), "%zu", length);
+		if (iio_write_attr(data, "buffer/length", num)) {
+			fprintf(stderr, "Failed to set iio buffer length\n");
+			goto free_data;
+		}
+	}
+
+	/* not all kernels have watermark, it's only an optimization */
+	snprintf(num, sizeof(num), "%zu", block);
+	iio_write_attr(data, "buffer/watermark", num);
+
+	data->rx = evbuffer_new();
+	data->out = evbuffer_new();
+	if (!data->rx || !data->out) {
+		fprintf(stderr, "Failed to allocate iio buffer\n");
+		goto free_buf;
+	}
+
+	snprintf(node, sizeof(node), "/dev/%s", strrchr(data->dir, '/') + 1);
+	fd = open(node, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s\n", node);
+		goto free_buf;
+	}
+
+	if (iio_write_attr(data, "buffer/enable", "1")) {
+		fprintf(stderr, "Failed to enable iio buffer\n");
+		goto close_fd;
+	}
+
+	data->fd = fd;
+	data->ev = event_new(self->base, fd, EV_READ | EV_PERSIST, upstream,
+			     self);
+	if (!data->ev) {
+		fprintf(stderr, "Failed to create iio event\n");
+		goto disable;
+	}
+	self->data = data;
+	event_add(data->ev, NULL);
+	return 0;
+
+disable:
+	iio_write_attr(data, "buffer/enable", "0");
+close_fd:
+	close(fd);
+free_buf:
+	if (data->rx)
+		evbuffer_free(data->rx);
+	if (data->out)
+		evbuffer_free(data->out);
+free_data:
+	free(data);
+	return -1;
+}
+
+static void iio_close(struct rteipc_ep *self)
+{
+	struct iio_data *data = self->data;
+
+	event_free(data->ev);
+	iio_write_attr(data, "buffer/enable", "0");
+	close(data->fd);
+	evbuffer_free(data->rx);
+	evbuffer_free(data->out);
+	free(data);
+}
+
+COMPATIBLE_WITH(iio, COMPAT_IPC);
+struct rteipc_ep_ops iio_ops = {
+	.on_data = iio_on_data,
+	.open = iio_open,
+	.close = iio_close,
+	.compatible = iio_compatible
+};
@@ -47,15 +47,18 @@ static void event_cb(struct bufferevent *bev, short events, void *arg)
 	data->cli = NULL;
 	/* accept another connection again */
 	evconnlistener_set_cb(data->el, listen_cb, (void *)self);
+	hangup_endpoint(self);
 }
 
 static void read_cb(struct bufferevent *bev, void *arg)
 {
 	struct rteipc_ep *self = arg;
 
-	if (self->bev)
+	if (self->bev) {
 		evbuffer_add_buffer(bufferevent_get_output(self->bev),
 				bufferevent_get_input(bev));
+		deliver_endpoint(self->bev);
+	}
 }
 
 static void error_cb(struct evconnlistener *el, void *arg)
@@ -15,7 +15,6 @@
 #include <event2/thread.h>
 #include "ep.h"
 #include "message.h"
-#include "list.h"
 #include "rteipc.h"
 
 /**
@@ -34,26 +33,43 @@
 
 #define MAX_LOOP_NAME		16
 
+/* Number of buckets of the loop name hash table */
+#define LOOP_HASH_SIZE		256
+
 struct loop {
-	node_t entry;
+	struct loop *hnext;  /* next in the hash bucket */
 	struct rteipc_ep *self;
 	char name[MAX_LOOP_NAME];
 	rteipc_lo_cb cb;
 	void *arg;
 };
 
-static list_t lo_list = LIST_INITIALIZER;
+/*
+ * Loops hashed by name, so that a transfer does not cost more as loops are
+ * added (e.g. rtemgrd opens one per interface).
+ */
+static struct loop *lo_hash[LOOP_HASH_SIZE];
+
+/* FNV-1a hash of name */
+static inline unsigned int lo_hash_key(const char *name)
+{
+	uint32_t h = 2166136261u;
+
+	while (*name) {
+		h ^= (uint8_t)*name++;
+		h *= 16777619u;
+	}
+	return h % LOOP_HASH_SIZE;
+}
 
 static inline struct loop *lookup_lo(const char *name)
 {
-	struct loop *lo;
-	node_t *n;
+	struct loop *lo = lo_hash[lo_hash_key(name)];
 
-	list_each(&lo_list, n, {
-		lo = list_entry(n, struct loop, entry);
+	for (; lo; lo = lo->hnext) {
 		if (!strcmp(lo->name, name))
 			return lo;
-	})
+	}
 	return NULL;
 }
 
@@ -233,7 +249,7 @@ static void loop_on_data(struct rteipc_ep *self, struct bufferevent *bev)
 
 static int loop_open(struct rteipc_ep *self, const char *path)
 {
-	struct loop *lo;
+	struct loop *lo, **head;
 
 	if (!strlen(path)) {
 		fprintf(stderr, "loop: name must be specified\n");
@@ -259,14 +275,23 @@ static int loop_open(struct rteipc_ep *self, const char *path)
 	strcpy(lo->name, path);
 	lo->self = self;
 	self->data = lo;
-	list_push(&lo_list, &lo->entry);
+	head = &lo_hash[lo_hash_key(lo->name)];
+	lo->hnext = *head;
+	*head = lo;
 	return 0;
 }
 
 static void loop_close(struct rteipc_ep *self)
 {
 	struct loop *lo = self->data;
-	list_remove(&lo_list, &lo->entry);
+	struct loop **pp = &lo_hash[lo_hash_key(lo->name)];
+
+	for (; *pp; pp = &(*pp)->hnext) {
+		if (*pp == lo) {
+			*pp = lo->hnext;
+			break;
+		}
+	}
 	free(lo);
 }
 
@@ -0,0 +1,266 @@
+// Copyright (c) 2021 Ryosuke Saito All rights reserved.
+// MIT licensed
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <event2/bufferevent.h>
+#include <event2/buffer.h>
+#include <event2/listener.h>
+#include <event2/util.h>
+#include <event2/event.h>
+#include "ep.h"
+#include "message.h"
+#include "shm.h"
+
+/**
+ * SHM endpoint
+ *
+ * Same as IPC endpoint, but a process connected to it exchanges messages
+ * through shared memory rings instead of the socket (see shm.h). The path is
+ * a Unix domain socket path ('@' prefixed for abstract), which is used only
+ * to pass the rings to the process and to know when it disconnects.
+ *
+ *   Input:  { ANY }
+ *   Output: { ANY }
+ *     data format is defined by the end users (i.e, process)
+ *
+ * Options:
+ *   size=bytes
+ *     Size of each ring (default 1MiB). A message must be shorter than half
+ *     of it.
+ */
+
+struct shm_data {
+	struct evconnlistener *el;
+	evutil_socket_t cli;  /* -1 if no process connected */
+	struct event *hup;    /* disconnection of cli */
+	struct event *wake;   /* woken up by the process */
+	struct shm_chan ch;
+	size_t ring_size;
+	char *path;
+};
+
+static void listen_cb(struct evconnlistener *, evutil_socket_t,
+				struct sockaddr *, int, void *);
+
+static void shmem_on_data(struct rteipc_ep *self, struct bufferevent *bev)
+{
+	struct shm_data *data = self->data;
+	struct evbuffer *in = bufferevent_get_input(bev);
+	int ret;
+
+	if (data->cli < 0)
+		return;
+
+	/* messages left in the input while the ring is full */
+	while ((ret = shm_chan_send_msg(&data->ch, in))) {
+		if (ret < 0)
+			fprintf(stderr, "Message too long for shm ring\n");
+	}
+}
+
+static void disconnect(struct rteipc_ep *self)
+{
+	struct shm_data *data = self->data;
+
+	event_free(data->hup);
+	event_free(data->wake);
+	shm_chan_destroy(&data->ch);
+	evutil_closesocket(data->cli);
+	data->cli = -1;
+	/* accept another connection again */
+	evconnlistener_set_cb(data->el, listen_cb, (void *)self);
+}
+
+static void wake_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct rteipc_ep *self = arg;
+	struct shm_data *data = self->data;
+	eventfd_t val;
+	size_t len;
+	void *msg;
+	int ret;
+
+	eventfd_read(fd, &val);
+
+	do {
+		while ((ret = shm_chan_recv(&data->ch, &msg, &len)) > 0) {
+			if (self->bev)
+				rteipc_buffer(self->bev, msg, len);
+			shm_chan_release(&data->ch);
+		}
+		if (ret < 0) {
+			fprintf(stderr, "shm ring corrupted\n");
+			disconnect(self);
+			hangup_endpoint(self);
+			return;
+		}
+	} while (!shm_chan_idle(&data->ch));
+
+	/* the process may have made space for messages left */
+	if (self->bev)
+		shmem_on_data(self, self->bev);
+}
+
+static void hup_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct rteipc_ep *self = arg;
+	char c;
+
+	/* nothing is sent over the socket, readable means closed */
+	if (recv(fd, &c, 1, 0) <= 0) {
+		printf("Connection closed.\n");
+		disconnect(self);
+		hangup_endpoint(self);
+	}
+}
+
+static void error_cb(struct evconnlistener *el, void *arg)
+{
+	struct rteipc_ep *self = arg;
+	int err = EVUTIL_SOCKET_ERROR();
+
+	fprintf(stderr, "Error %d (%s) on the listener\n", err,
+			evutil_socket_error_to_string(err));
+	event_base_loopexit(self->base, NULL);
+}
+
+static void listen_cb(struct evconnlistener *el, evutil_socket_t fd,
+				struct sockaddr *sa, int socklen, void *arg)
+{
+	struct rteipc_ep *self = arg;
+	struct shm_data *data = self->data;
+
+	if (shm_chan_create(&data->ch, data->ring_size))
+		goto close_fd;
+
+	if (shm_chan_send_fds(&data->ch, fd)) {
+		fprintf(stderr, "Failed to pass shm ring\n");
+		goto destroy;
+	}
+
+	data->hup = event_new(self->base, fd, EV_READ | EV_PERSIST,
+			      hup_cb, self);
+	data->wake = event_new(self->base, data->ch.efd, EV_READ | EV_PERSIST,
+			       wake_cb, self);
+	if (!data->hup || !data->wake) {
+		fprintf(stderr, "Error constructing shm events\n");
+		goto free_ev;
+	}
+
+	/* accept only one connection */
+	evconnlistener_set_cb(el, NULL, NULL);
+
+	data->cli = fd;
+	event_add(data->hup, NULL);
+	event_add(data->wake, NULL);
+	/* take messages sent as soon as the process received the ring */
+	event_active(data->wake, EV_READ, 0);
+	if (self->bev)
+		shmem_on_data(self, self->bev);
+	return;
+
+free_ev:
+	if (data->hup)
+		event_free(data->hup);
+	if (data->wake)
+		event_free(data->wake);
+destroy:
+	shm_chan_destroy(&data->ch);
+close_fd:
+	evutil_closesocket(fd);
+}
+
+static int shmem_open(struct rteipc_ep *self, const char *path)
+{
+	struct sockaddr_un sun;
+	struct shm_data *data;
+	char spath[108] = {0}, opts[64] = {0}, *key, *val, *save;
+	int addrlen;
+
+	data = malloc(sizeof(*data));
+	if (!data) {
+		fprintf(stderr, "Failed to allocate memory for ep_shm\n");
+		return -1;
+	}
+
+	memset(data, 0, sizeof(*data));
+	data->cli = -1;
+	data->ring_size = SHM_RING_SIZE_DEFAULT;
+
+	sscanf(path, "%107[^,],%63[^\n]", spath, opts);
+	for (key = strtok_r(opts, ",", &save); key;
+			key = strtok_r(NULL, ",", &save)) {
+		if ((val = strchr(key, '=')))
+			*val++ = '\0';
+
+		if (!strcmp(key, "size") && val) {
+			data->ring_size = strtoul(val, NULL, 0);
+		} else {
+			fprintf(stderr, "Invalid shm option:%s\n", key);
+			goto free_data;
+		}
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, spath, sizeof(sun.sun_path) - 1);
+	addrlen = offsetof(struct sockaddr_un, sun_path) + strlen(spath) + 1;
+
+	if (sun.sun_path[0] == '@') {
+		sun.sun_path[0] = 0;
+		addrlen = addrlen - 1;
+	} else {
+		unlink(spath);
+		data->path = strdup(spath);
+	}
+
+	data->el = evconnlistener_new_bind(
+			self->base, listen_cb, (void *)self,
+			(LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE), -1,
+			(struct sockaddr *)&sun, addrlen);
+	if (!data->el) {
+		fprintf(stderr, "Could not create a listener\n");
+		free(data->path);
+		goto free_data;
+	}
+
+	evconnlistener_set_error_cb(data->el, error_cb);
+	self->data = data;
+	return 0;
+
+free_data:
+	free(data);
+	return -1;
+}
+
+static void shmem_close(struct rteipc_ep *self)
+{
+	struct shm_data *data = self->data;
+
+	if (data->cli >= 0)
+		disconnect(self);
+
+	evconnlistener_free(data->el);
+
+	if (data->path) {
+		unlink(data->path);
+		free(data->path);
+	}
+
+	free(data);
+}
+
+COMPATIBLE_WITH(shm, COMPAT_ANY);
+struct rteipc_ep_ops shm_ops = {
+	.on_data = shmem_on_data,
+	.open = shmem_open,
+	.close = shmem_close,
+	.compatible = shm_compatible
+};
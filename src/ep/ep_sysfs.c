@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
@@ -11,6 +12,7 @@
 #include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
 #include <libudev.h>
 #include <event2/bufferevent.h>
 #include <event2/buffer.h>
@@ -20,6 +22,7 @@
 #include <event2/thread.h>
 #include "ep.h"
 #include "message.h"
+#include "list.h"
 
 /**
  * SYSFS endpoint
@@ -27,74 +30,426 @@
  * Data format:
  *   Input  { char[] }
  *     arg1 - string as 'attr=value' pair for setting or 'attr' for reading
- *            value
+ *            value, '+attr' for subscribing to changes of the attribute and
+ *            '-attr' for unsubscribing
  *
  *   Output { char[] }
- *     arg1 - 'attr=value' string if a read requested
+ *     arg1 - 'attr=value' string if a read requested, or a subscribed
+ *            attribute has changed
+ *
+ * Several requests can be given in one message separated by '\n' (e.g.
+ * "voltage_now\ncurrent_now\nstatus"). The values read are then sent back in
+ * one message as 'attr=value' strings separated by '\n' in the same order.
+ * Values are not escaped, so an attribute whose value spans several lines
+ * should be read in a request of its own.
+ *
+ * A subscribed attribute is sent out once on subscription, then every time
+ * the kernel notifies it by sysfs_notify() (POLLPRI), and when a change
+ * uevent of the device arrives and its value differs from the last one sent.
+ *
+ * Attribute files are opened on first use and kept open, reads and writes
+ * are done with pread/pwrite on them. A link attribute (e.g. 'driver',
+ * 'subsystem') reads as the name of its target as libudev does, and cannot
+ * be set or subscribed. Directories are not attributes and are rejected.
  */
 
+/* Max length of an attribute value, that of a sysfs page */
+#define SYSFS_VALUE_MAX		4096
+
+struct sysfs_attr {
+	char *name;
+	int fd;               /* -1 for a link */
+	bool link;
+	bool watched;
+	char *last;           /* value sent last while watched */
+	size_t last_len;
+	node_t node;
+};
+
 struct sysfs_data {
 	struct udev_device *device;
+	const char *syspath;
+	list_t attrs;         /* attributes opened */
+	struct evbuffer *out; /* response to a request */
+	int epfd;             /* epoll for POLLPRI of watched attributes */
+	struct event *pri;
+	struct udev_monitor *mon;
+	struct event *uevent;
+	char req[PATH_MAX];   /* request being handled */
+	char res[PATH_MAX + SYSFS_VALUE_MAX]; /* 'attr=value' response */
 };
 
+/**
+ * Return the attribute named @name, opening it on first use so that later
+ * requests are served with pread/pwrite on the cached fd.
+ */
+static struct sysfs_attr *attr_get(struct sysfs_data *data, const char *name)
+{
+	struct sysfs_attr *attr;
+	char path[PATH_MAX];
+	struct stat st;
+	node_t *n;
+	int fd = -1;
+
+	/* walk the nodes as they are, no iterator to allocate per request */
+	for (n = data->attrs.head; n; n = n->next) {
+		attr = list_entry(n, struct sysfs_attr, node);
+		if (!strcmp(attr->name, name))
+			return attr;
+	}
+
+	if (!*name || strstr(name, "..")) {
+		fprintf(stderr, "Invalid attr:%s\n", name);
+		return NULL;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", data->syspath, name);
+	if (lstat(path, &st) < 0)
+		return NULL;
+
+	if (S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "Not an attr but a directory:%s\n", name);
+		return NULL;
+	}
+
+	if (!S_ISLNK(st.st_mode)) {
+		fd = open(path, O_RDWR | O_CLOEXEC);
+		if (fd < 0 && errno == EACCES)
+			fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0 && errno == EACCES)
+			fd = open(path, O_WRONLY | O_CLOEXEC);
+		if (fd < 0)
+			return NULL;
+	}
+
+	attr = malloc(sizeof(*attr));
+	if (!attr || !(attr->name = strdup(name))) {
+		fprintf(stderr, "Failed to allocate memory for attr\n");
+		free(attr);
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	attr->fd = fd;
+	attr->link = S_ISLNK(st.st_mode);
+	attr->watched = false;
+	attr->last = NULL;
+	list_push(&data->attrs, &attr->node);
+	return attr;
+}
+
+static int attr_set(struct sysfs_data *data, const char *name,
+		const char *value, size_t len)
+{
+	struct sysfs_attr *attr = attr_get(data, name);
+	ssize_t ret;
+
+	if (!attr || attr->link)
+		return -1;
+
+	do {
+		ret = pwrite(attr->fd, value, len, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	return (ret < 0) ? -1 : 0;
+}
+
+/* Read the name of the target of a link attribute */
+static ssize_t link_read(struct sysfs_data *data, struct sysfs_attr *attr,
+		char *buf, size_t size)
+{
+	char path[PATH_MAX], target[PATH_MAX], *base;
+	ssize_t ret;
+
+	snprintf(path, sizeof(path), "%s/%s", data->syspath, attr->name);
+	ret = readlink(path, target, sizeof(target) - 1);
+	if (ret < 0)
+		return -1;
+	target[ret] = '\0';
+
+	base = strrchr(target, '/');
+	base = base ? base + 1 : target;
+	ret = strlen(base);
+	if (ret > size)
+		ret = size;
+	memcpy(buf, base, ret);
+	return ret;
+}
+
+/**
+ * Read the value of an attribute into @buf and return its length without
+ * trailing newlines, or -1 on error.
+ */
+static ssize_t attr_read(struct sysfs_data *data, const char *name,
+		char *buf, size_t size)
+{
+	struct sysfs_attr *attr = attr_get(data, name);
+	ssize_t ret;
+
+	if (!attr)
+		return -1;
+
+	if (attr->link)
+		return link_read(data, attr, buf, size);
+
+	do {
+		ret = pread(attr->fd, buf, size, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	while (ret > 0 && buf[ret - 1] == '\n')
+		ret--;
+	return ret;
+}
+
+static void attr_unwatch(struct sysfs_data *data, struct sysfs_attr *attr)
+{
+	epoll_ctl(data->epfd, EPOLL_CTL_DEL, attr->fd, NULL);
+	attr->watched = false;
+	free(attr->last);
+	attr->last = NULL;
+}
+
+/**
+ * Send out the current value of a watched attribute. If @changed, it is sent
+ * only when it differs from the last one sent.
+ */
+static void attr_notify(struct rteipc_ep *self, struct sysfs_attr *attr,
+		bool changed)
+{
+	struct sysfs_data *data = self->data;
+	size_t n;
+	ssize_t ret;
+	char *last;
+
+	/* reading the value also re-arms POLLPRI */
+	n = snprintf(data->res, sizeof(data->res), "%s=", attr->name);
+	ret = attr_read(data, attr->name, data->res + n, sizeof(data->res) - n);
+	if (ret < 0) {
+		/* POLLPRI may stay pending and wake us up forever */
+		fprintf(stderr, "Error reading attr:%s(%d), unsubscribed\n",
+				attr->name, errno);
+		attr_unwatch(data, attr);
+		return;
+	}
+
+	if (changed && attr->last && attr->last_len == ret &&
+			!memcmp(attr->last, data->res + n, ret))
+		return;
+
+	if ((last = realloc(attr->last, ret + 1))) {
+		memcpy(last, data->res + n, ret);
+		attr->last = last;
+		attr->last_len = ret;
+	}
+
+	if (self->bev)
+		rteipc_buffer(self->bev, data->res, n + ret);
+}
+
+static void pri_event(evutil_socket_t fd, short what, void *arg)
+{
+	struct rteipc_ep *self = arg;
+	struct epoll_event evs[16];
+	int i, n;
+
+	n = epoll_wait(fd, evs, sizeof(evs) / sizeof(evs[0]), 0);
+	for (i = 0; i < n; i++)
+		attr_notify(self, evs[i].data.ptr, false);
+}
+
+static void uevent_event(evutil_socket_t fd, short what, void *arg)
+{
+	struct rteipc_ep *self = arg;
+	struct sysfs_data *data = self->data;
+	struct udev_device *dev;
+	struct sysfs_attr *attr;
+	const char *action;
+	node_t *n;
+
+	dev = udev_monitor_receive_device(data->mon);
+	if (!dev)
+		return;
+
+	action = udev_device_get_action(dev);
+	if (action && !strcmp(action, "change") &&
+			!strcmp(udev_device_get_syspath(dev), data->syspath)) {
+		list_each(&data->attrs, n, {
+			attr = list_entry(n, struct sysfs_attr, node);
+			if (attr->watched)
+				attr_notify(self, attr, true);
+		})
+	}
+	udev_device_unref(dev);
+}
+
+/**
+ * Set up epoll for POLLPRI and the uevent monitor on first subscription.
+ * The monitor is optional, attributes notified by sysfs_notify() are still
+ * delivered without it.
+ */
+static int watch_init(struct rteipc_ep *self)
+{
+	struct sysfs_data *data = self->data;
+	struct udev *udev = udev_device_get_udev(data->device);
+	const char *subsystem;
+
+	if (data->pri)
+		return 0;
+
+	data->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (data->epfd < 0) {
+		fprintf(stderr, "Failed to create epoll(%d)\n", errno);
+		return -1;
+	}
+
+	data->pri = event_new(self->base, data->epfd, EV_READ | EV_PERSIST,
+			      pri_event, self);
+	if (!data->pri) {
+		fprintf(stderr, "Failed to create sysfs event\n");
+		close(data->epfd);
+		return -1;
+	}
+	event_add(data->pri, NULL);
+
+	data->mon = udev_monitor_new_from_netlink(udev, "kernel");
+	if (!data->mon)
+		goto no_monitor;
+
+	subsystem = udev_device_get_subsystem(data->device);
+	if (subsystem)
+		udev_monitor_filter_add_match_subsystem_devtype(data->mon,
+				subsystem, NULL);
+	if (udev_monitor_enable_receiving(data->mon) < 0)
+		goto free_monitor;
+
+	data->uevent = event_new(self->base, udev_monitor_get_fd(data->mon),
+				 EV_READ | EV_PERSIST, uevent_event, self);
+	if (!data->uevent)
+		goto free_monitor;
+	event_add(data->uevent, NULL);
+	return 0;
+
+free_monitor:
+	udev_monitor_unref(data->mon);
+	data->mon = NULL;
+no_monitor:
+	fprintf(stderr, "No uevent notification for %s\n", data->syspath);
+	return 0;
+}
+
+static void attr_watch(struct rteipc_ep *self, const char *name, bool on)
+{
+	struct sysfs_data *data = self->data;
+	struct sysfs_attr *attr;
+	struct epoll_event ev;
+
+	if (on && watch_init(self))
+		return;
+
+	attr = attr_get(data, name);
+	if (!attr || attr->link) {
+		fprintf(stderr, "Error watching attr:%s\n", name);
+		return;
+	}
+
+	if (attr->watched == on)
+		return;
+
+	if (!on) {
+		attr_unwatch(data, attr);
+		return;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLPRI | EPOLLERR;
+	ev.data.ptr = attr;
+	if (epoll_ctl(data->epfd, EPOLL_CTL_ADD, attr->fd, &ev) < 0) {
+		fprintf(stderr, "Error watching attr:%s(%d)\n", name, errno);
+		return;
+	}
+
+	attr->watched = true;
+	attr_notify(self, attr, false);
+}
+
+/**
+ * Handle a request in @text of @len bytes, appending the 'attr=value' of a
+ * read to data->out.
+ */
+static void sysfs_request(struct rteipc_ep *self, char *text, size_t len)
+{
+	struct sysfs_data *data = self->data;
+	char *pos;
+	size_t n;
+	ssize_t ret;
+
+	/*
+	 * A msg passed as "attr=value" pair for setting, as "attr" for
+	 * getting value. Setting a NULL value "attr=" is also
+	 * acceptable.
+	 */
+	if (*text == '+' || *text == '-') {
+		attr_watch(self, text + 1, *text == '+');
+	} else if ((pos = strchr(text, '='))) {
+		*pos++ = '\0';
+		if (attr_set(data, text, pos, text + len - pos)) {
+			fprintf(stderr, "Error setting attr:%s value:%s\n",
+					text, *pos ? pos : "NULL");
+		}
+	} else {
+		/* read the value right after 'attr=' in the response */
+		n = snprintf(data->res, sizeof(data->res), "%s=", text);
+		ret = attr_read(data, text, data->res + n,
+				sizeof(data->res) - n);
+		if (ret < 0) {
+			fprintf(stderr, "Error getting attr:%s\n", text);
+			return;
+		}
+		if (evbuffer_get_length(data->out))
+			evbuffer_add(data->out, "\n", 1);
+		evbuffer_add(data->out, data->res, n + ret);
+	}
+}
+
 static void sysfs_on_data(struct rteipc_ep *self, struct bufferevent *bev)
 {
 	struct sysfs_data *data = self->data;
 	struct evbuffer *in = bufferevent_get_input(bev);
-	const char *value;
-	char *msg, *pos, *text, buf[PATH_MAX];
+	char *text = data->req, *line, *end;
 	size_t len;
-	int ret;
+	ssize_t ret;
 
 	for (;;) {
-		if (!(ret = rteipc_msg_drain(in, &len, &msg)))
+		/* leave room for a terminating null byte */
+		ret = rteipc_msg_remove(in, text, sizeof(data->req) - 1, &len);
+		if (!ret)
 			return;
 
 		if (ret < 0) {
 			fprintf(stderr, "Error reading data\n");
-			return;
+			continue;
 		}
+		text[len] = '\0';
 
 		/*
-		 * Duplicate a new string to ensure having a terminating null
-		 * byte.
+		 * Requests can be batched separated by newlines, values read
+		 * are sent back together as one message.
 		 */
-		text = strndup(msg, len);
-		free(msg);
-
-		/*
-		 * A msg passed as "attr=value" pair for setting, as "attr" for
-		 * getting value. Setting a NULL value "attr=" is also
-		 * acceptable.
-		 */
-		if ((pos = strchr(text, '='))) {
-			*pos = '\0';
-			/* NULL value ? */
-			if (text + len <= ++pos)
-				pos = NULL;
-
-			if (udev_device_set_sysattr_value(data->device,
-						text, pos) != 0) {
-				fprintf(stderr,
-					"Error setting attr:%s value:%s\n",
-					text, pos ?: "NULL");
-				goto free_msg;
-			}
-		} else {
-			value = udev_device_get_sysattr_value(
-					data->device, text);
-			if (value) {
-				snprintf(buf, sizeof(buf), "%s=%s", text, value);
-				if (self->bev)
-					rteipc_buffer(self->bev,
-						      buf, strlen(buf));
-			} else {
-				fprintf(stderr,
-					"Error getting attr:%s\n", text);
-			}
+		for (line = text; line < text + len; line = end + 1) {
+			if ((end = strchr(line, '\n')))
+				*end = '\0';
+			else
+				end = text + len;
+			if (end > line)
+				sysfs_request(self, line, end - line);
 		}
-free_msg:
-		free(text);
+
+		if (!evbuffer_get_length(data->out))
+			continue;
+		if (self->bev)
+			rteipc_evbuffer(self->bev, data->out);
+		else
+			evbuffer_drain(data->out, evbuffer_get_length(data->out));
 	}
 }
 
@@ -129,8 +484,16 @@ static int sysfs_open(struct rteipc_ep *self, const char *path)
 		}
 	}
 
+	if (device && !(data->out = evbuffer_new())) {
+		fprintf(stderr, "Failed to allocate sysfs buffer\n");
+		udev_device_unref(device);
+		device = NULL;
+	}
+
 	if (device) {
 		data->device = device;
+		data->syspath = udev_device_get_syspath(device);
+		list_init(&data->attrs);
 		self->data = data;
 		return 0;
 	}
@@ -145,6 +508,27 @@ free_data:
 static void sysfs_close(struct rteipc_ep *self)
 {
 	struct sysfs_data *data = self->data;
+	struct sysfs_attr *attr;
+	node_t *n;
+
+	if (data->uevent)
+		event_free(data->uevent);
+	if (data->mon)
+		udev_monitor_unref(data->mon);
+	if (data->pri) {
+		event_free(data->pri);
+		close(data->epfd);
+	}
+
+	while ((n = list_pop(&data->attrs))) {
+		attr = list_entry(n, struct sysfs_attr, node);
+		if (attr->fd >= 0)
+			close(attr->fd);
+		free(attr->last);
+		free(attr->name);
+		free(attr);
+	}
+	evbuffer_free(data->out);
 	udev_device_unref(data->device);
 	free(data);
 }
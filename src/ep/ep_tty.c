@@ -6,17 +6,20 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <termios.h>
 #include <signal.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+#include <linux/serial.h>
 #include <event2/bufferevent.h>
 #include <event2/buffer.h>
 #include <event2/listener.h>
 #include <event2/util.h>
 #include <event2/event.h>
 #include <event2/thread.h>
+#include "rteipc.h"
 #include "ep.h"
 #include "message.h"
 
@@ -29,28 +32,370 @@
  *
  *   Output { char[] }
  *     arg1 - rx buffer
+ *
+ * Options:
+ *   coalesce=usec
+ *     Hold received bytes for up to 'usec' microseconds after the first one
+ *     and send them out as one message.
+ *   chunk=bytes
+ *     With coalesce, send out the message as soon as 'bytes' are held
+ *     (default 4096).
+ *   frame={line|slip|cobs|len8|len16|fixed|idle}
+ *     Send out exactly one message per protocol frame received, instead of
+ *     whatever a read returned. Delimiters and length prefixes are removed,
+ *     and SLIP and COBS frames are decoded. Empty frames are dropped.
+ *       line  - terminated by '\n'
+ *       slip  - RFC 1055 SLIP, delimited by 0xc0
+ *       cobs  - COBS encoded, delimited by 0x00
+ *       len8  - prefixed by its length in 1 byte
+ *       len16 - prefixed by its length in 2 bytes (big endian)
+ *       fixed - 'size=bytes' long
+ *       idle  - ended by no byte received for 'gap=usec' microseconds
+ *     A frame longer than 64KB is discarded up to the next delimiter, or the
+ *     rest of the stream with length prefixes. An idle frame is sent out
+ *     once 64KB has been received instead, since there is no delimiter to
+ *     find.
+ *   size=bytes
+ *     Frame size for 'frame=fixed'.
+ *   gap=usec
+ *     Inter-frame gap for 'frame=idle'.
+ *
+ *   coalesce cannot be used along with frame.
+ *
+ *   txmax=bytes
+ *     Stop taking messages to transmit while 'bytes' are waiting to be
+ *     written to the tty (default 65536). rteipc_tty_pending() returns the
+ *     number of bytes waiting.
+ *
+ *   bits={5|6|7|8}
+ *     Character size (default 8).
+ *   parity={none|odd|even|mark|space}
+ *     Parity (default none).
+ *   stop={1|2}
+ *     Stop bits (default 1).
+ *   flow={none|rtscts|xonxoff}
+ *     Flow control (default none).
+ *   low_latency
+ *     Set ASYNC_LOW_LATENCY to the serial driver so that received bytes are
+ *     pushed to the tty without driver-side buffering delay.
+ *
+ *   rs485
+ *     Let the driver drive RTS for RS-485 half-duplex direction control
+ *     (TIOCSRS485).
+ *   rts={high|low}
+ *     Level of RTS while sending with rs485 (default high).
+ *   rts_before=msec, rts_after=msec
+ *     Delay after RTS is set before sending, and before RTS is released
+ *     after sending with rs485.
+ *   xact=usec
+ *     Transaction mode. Each message is written as a request, and bytes
+ *     received within 'usec' microseconds after it has been transmitted are
+ *     sent out as one response message. The time to transmit the request is
+ *     worked out from its length, the baud rate and the character format
+ *     (plus rts_before with rs485), and added to 'usec' once the request is
+ *     written to the tty. The next message is not written until the
+ *     transaction ends. Bytes received outside a transaction are discarded.
+ *     With 'frame=idle', the response also ends at the inter-frame gap.
+ *     xact can be used only with frame=idle among coalesce and frame.
+ *
+ * The baud rate can be any value the driver supports (e.g. 1000000,
+ * 3000000), it is set through termios2 with BOTHER.
  */
 
+/* Bounds of a single read from the tty */
+#define TTY_READ_MIN		256
+#define TTY_READ_MAX		65536
+
+/* Default size to flush coalesced bytes */
+#define TTY_CHUNK_DEFAULT	4096
+
+/* Default size of tx over which the endpoint stops taking messages */
+#define TTY_TXMAX_DEFAULT	65536
+
+/* Max size of a protocol frame, longer ones are discarded (split if idle) */
+#define TTY_FRAME_MAX		65536
+
+enum {
+	FRAME_RAW,
+	FRAME_LINE,
+	FRAME_SLIP,
+	FRAME_COBS,
+	FRAME_LEN8,
+	FRAME_LEN16,
+	FRAME_FIXED,
+	FRAME_IDLE,
+};
+
+enum {
+	FLOW_NONE,
+	FLOW_RTSCTS,
+	FLOW_XONXOFF,
+};
+
+#define SLIP_END		0xc0
+#define SLIP_ESC		0xdb
+#define SLIP_ESC_END		0xdc
+#define SLIP_ESC_ESC		0xdd
+
 struct tty_data {
 	int fd;
 	struct event *ev;
+	struct evbuffer *rx;  /* bytes received but not sent out yet */
+	unsigned long coalesce_us;
+	size_t chunk;
+	struct event *timer;
+	int frame;            /* FRAME_* */
+	size_t frame_size;    /* for FRAME_FIXED */
+	unsigned long gap_us; /* for FRAME_IDLE */
+	size_t scanned;       /* bytes in rx searched for a delimiter */
+	bool discard;         /* in a frame too long, up to the next delimiter */
+	struct evbuffer *out; /* frame to be sent out */
+	uint8_t *scratch;     /* for decoding SLIP and COBS */
+	struct evbuffer *tx;  /* bytes to be written to the tty */
+	struct event *wev;
+	size_t txmax;
+	unsigned int speed;
+	unsigned int bits;
+	tcflag_t parity;      /* 0, PARENB | PARODD | CMSPAR */
+	bool cstopb;
+	int flow;             /* FLOW_* */
+	bool low_latency;
+	bool rs485;
+	bool rts_low;         /* RTS low while sending */
+	unsigned int rts_before_ms;
+	unsigned int rts_after_ms;
+	unsigned long xact_us;
+	size_t xact_len;      /* length of the request in progress */
+	bool busy;            /* transaction in progress */
+	struct event *xtimer; /* transaction timeout */
 };
 
-static void upstream(evutil_socket_t fd, short what, void *arg)
+/**
+ * Send out all received bytes as a message.
+ */
+static void tty_flush(struct rteipc_ep *self)
+{
+	struct tty_data *data = self->data;
+
+	if (!self->bev || !evbuffer_get_length(data->rx))
+		return;
+
+	/* rx is emptied by moving its chains to the partner */
+	rteipc_evbuffer(self->bev, data->rx);
+}
+
+static void tty_on_data(struct rteipc_ep *self, struct bufferevent *bev);
+
+/**
+ * End the transaction in progress, sending out the response if any, and
+ * take the next request.
+ */
+static void xact_end(struct rteipc_ep *self)
+{
+	struct tty_data *data = self->data;
+
+	evtimer_del(data->xtimer);
+	if (data->timer)
+		evtimer_del(data->timer);
+	tty_flush(self);
+	data->busy = false;
+
+	if (self->bev)
+		tty_on_data(self, self->bev);
+}
+
+static void xact_timeout(evutil_socket_t fd, short what, void *arg)
+{
+	xact_end(arg);
+}
+
+static void flush_timeout(evutil_socket_t fd, short what, void *arg)
 {
 	struct rteipc_ep *self = arg;
 	struct tty_data *data = self->data;
-	struct evbuffer *buf = evbuffer_new();
-	char msg[256];
-	size_t len, nl;
-	int ret;
 
-	if (!self->bev)
+	if (data->xact_us)
+		xact_end(self);
+	else
+		tty_flush(self);
+}
+
+/* Decode SLIP escapes in place and return the decoded length */
+static size_t slip_decode(uint8_t *buf, size_t len)
+{
+	uint8_t *src = buf, *dst = buf, *end = buf + len, *esc;
+	size_t n;
+
+	while (src < end) {
+		/* copy up to the next escape at once */
+		esc = memchr(src, SLIP_ESC, end - src);
+		n = (esc ?: end) - src;
+		memmove(dst, src, n);
+		dst += n;
+		src += n;
+		if (!esc || ++src >= end)
+			break;
+		if (*src == SLIP_ESC_END)
+			*dst++ = SLIP_END;
+		else if (*src == SLIP_ESC_ESC)
+			*dst++ = SLIP_ESC;
+		else
+			*dst++ = *src;
+		src++;
+	}
+	return dst - buf;
+}
+
+/* Decode COBS in place and return the decoded length, -1 if malformed */
+static ssize_t cobs_decode(uint8_t *buf, size_t len)
+{
+	uint8_t *src = buf, *dst = buf, *end = buf + len;
+	uint8_t code;
+
+	while (src < end) {
+		code = *src++;
+		if (!code || code - 1 > end - src)
+			return -1;
+		memmove(dst, src, code - 1);
+		dst += code - 1;
+		src += code - 1;
+		if (code != 0xff && src < end)
+			*dst++ = 0;
+	}
+	return dst - buf;
+}
+
+/**
+ * Send out the first @len bytes of rx as a frame, decoding them if needed.
+ */
+static void send_frame(struct rteipc_ep *self, size_t len)
+{
+	struct tty_data *data = self->data;
+	ssize_t n = len;
+
+	if (len > TTY_FRAME_MAX) {
+		fprintf(stderr, "Discarded tty frame exceeding %d bytes\n",
+				TTY_FRAME_MAX);
+		evbuffer_drain(data->rx, len);
 		return;
+	}
+
+	if (data->frame == FRAME_SLIP || data->frame == FRAME_COBS) {
+		evbuffer_remove(data->rx, data->scratch, len);
+		if (data->frame == FRAME_SLIP)
+			n = slip_decode(data->scratch, len);
+		else
+			n = cobs_decode(data->scratch, len);
+		if (n < 0) {
+			fprintf(stderr, "Discarded malformed tty frame\n");
+			return;
+		}
+		evbuffer_add(data->out, data->scratch, n);
+	} else {
+		evbuffer_remove_buffer(data->rx, data->out, len);
+	}
+
+	if (n > 0)
+		rteipc_evbuffer(self->bev, data->out);
+}
+
+/**
+ * Split rx into protocol frames and send them out. Incomplete frame is
+ * left in rx until more bytes arrive.
+ *
+ * Delimiters are searched by evbuffer_search(), which scans each chain with
+ * memchr() and so the vectorized implementation of libc; bytes already
+ * searched are not searched again.
+ */
+static void tty_deframe(struct rteipc_ep *self)
+{
+	struct tty_data *data = self->data;
+	struct evbuffer_ptr pos;
+	size_t len, hlen, n;
+	uint8_t delim, hdr[2];
+
+	for (;;) {
+		len = evbuffer_get_length(data->rx);
+
+		switch (data->frame) {
+		case FRAME_LINE:
+		case FRAME_SLIP:
+		case FRAME_COBS:
+			delim = (data->frame == FRAME_LINE) ? '\n' :
+				(data->frame == FRAME_SLIP) ? SLIP_END : 0;
+			evbuffer_ptr_set(data->rx, &pos, data->scanned,
+					EVBUFFER_PTR_SET);
+			pos = evbuffer_search(data->rx, (char *)&delim, 1, &pos);
+			if (pos.pos < 0) {
+				data->scanned = len;
+				goto out;
+			}
+			data->scanned = 0;
+			if (data->discard) {
+				/* the tail of the frame too long, resync */
+				evbuffer_drain(data->rx, pos.pos + 1);
+				data->discard = false;
+				break;
+			}
+			send_frame(self, pos.pos);
+			evbuffer_drain(data->rx, 1);
+			break;
+		case FRAME_LEN8:
+		case FRAME_LEN16:
+			hlen = (data->frame == FRAME_LEN8) ? 1 : 2;
+			if (len < hlen)
+				goto out;
+			evbuffer_copyout(data->rx, hdr, hlen);
+			n = (hlen == 1) ? hdr[0] : (hdr[0] << 8) | hdr[1];
+			if (len < hlen + n)
+				goto out;
+			evbuffer_drain(data->rx, hlen);
+			send_frame(self, n);
+			break;
+		case FRAME_FIXED:
+			if (len < data->frame_size)
+				goto out;
+			send_frame(self, data->frame_size);
+			break;
+		default:
+			return;
+		}
+	}
+out:
+	if (data->discard) {
+		/* no delimiter yet, keep dropping the frame too long */
+		evbuffer_drain(data->rx, len);
+		data->scanned = 0;
+	} else if (len > TTY_FRAME_MAX) {
+		fprintf(stderr, "Discarded tty frame exceeding %d bytes\n",
+				TTY_FRAME_MAX);
+		evbuffer_drain(data->rx, len);
+		data->scanned = 0;
+		/* with delimiters, the rest goes up to the next one */
+		data->discard = data->frame == FRAME_LINE ||
+				data->frame == FRAME_SLIP ||
+				data->frame == FRAME_COBS;
+	}
+}
+
+static void upstream(evutil_socket_t fd, short what, void *arg)
+{
+	struct rteipc_ep *self = arg;
+	struct tty_data *data = self->data;
+	struct timeval tv;
+	int avail, len;
 
-	len = read(fd, msg, sizeof(msg));
+	/* Size the read by what the driver has, within the bounds */
+	if (ioctl(fd, FIONREAD, &avail) < 0 || avail < TTY_READ_MIN)
+		avail = TTY_READ_MIN;
+	else if (avail > TTY_READ_MAX)
+		avail = TTY_READ_MAX;
+
+	len = evbuffer_read(data->rx, fd, avail);
 
 	if (len <= 0) {
+		if (len == -1 && (errno == EAGAIN || errno == EINTR))
+			return;
 		if (len == -1)
 			fprintf(stderr, "tty upstream error:%d\n", errno);
 		else if (len == 0)
@@ -59,16 +404,93 @@ static void upstream(evutil_socket_t fd, short what, void *arg)
 		return;
 	}
 
-	evbuffer_add(buf, msg, len);
-	len = evbuffer_get_length(buf);
-	nl = htonl(len);
-	evbuffer_prepend(buf, &nl, 4);
-	bufferevent_write_buffer(self->bev, buf);
+	/* discard data if it's not bound yet */
+	if (!self->bev) {
+		evbuffer_drain(data->rx, evbuffer_get_length(data->rx));
+		data->scanned = 0;
+		return;
+	}
+
+	if (data->xact_us) {
+		if (!data->busy) {
+			evbuffer_drain(data->rx, evbuffer_get_length(data->rx));
+		} else if (evbuffer_get_length(data->rx) >= TTY_FRAME_MAX) {
+			xact_end(self);
+		} else if (data->frame == FRAME_IDLE) {
+			tv.tv_sec = data->gap_us / 1000000;
+			tv.tv_usec = data->gap_us % 1000000;
+			evtimer_add(data->timer, &tv);
+		}
+		return;
+	}
+
+	switch (data->frame) {
+	case FRAME_RAW:
+		if (!data->coalesce_us ||
+				evbuffer_get_length(data->rx) >= data->chunk) {
+			if (data->timer)
+				evtimer_del(data->timer);
+			tty_flush(self);
+		} else if (!evtimer_pending(data->timer, NULL)) {
+			tv.tv_sec = data->coalesce_us / 1000000;
+			tv.tv_usec = data->coalesce_us % 1000000;
+			evtimer_add(data->timer, &tv);
+		}
+		break;
+	case FRAME_IDLE:
+		/* split rather than discard, there is no delimiter to resync */
+		if (evbuffer_get_length(data->rx) >= TTY_FRAME_MAX) {
+			evtimer_del(data->timer);
+			tty_flush(self);
+			break;
+		}
+		/* restart the gap on every read */
+		tv.tv_sec = data->gap_us / 1000000;
+		tv.tv_usec = data->gap_us % 1000000;
+		evtimer_add(data->timer, &tv);
+		break;
+	default:
+		tty_deframe(self);
+		break;
+	}
+}
+
+static void set_low_latency(int fd)
+{
+	struct serial_struct ss;
+
+	if (ioctl(fd, TIOCGSERIAL, &ss) < 0) {
+		fprintf(stderr, "low_latency not supported by the driver\n");
+		return;
+	}
+
+	ss.flags |= ASYNC_LOW_LATENCY;
+	if (ioctl(fd, TIOCSSERIAL, &ss) < 0)
+		fprintf(stderr, "Failed to set low_latency\n");
+}
+
+static int set_rs485(int fd, struct tty_data *data)
+{
+	struct serial_rs485 rs485;
+
+	memset(&rs485, 0, sizeof(rs485));
+	rs485.flags = SER_RS485_ENABLED;
+	rs485.flags |= data->rts_low ? SER_RS485_RTS_AFTER_SEND :
+				       SER_RS485_RTS_ON_SEND;
+	rs485.delay_rts_before_send = data->rts_before_ms;
+	rs485.delay_rts_after_send = data->rts_after_ms;
+
+	if (ioctl(fd, TIOCSRS485, &rs485) < 0) {
+		fprintf(stderr, "Failed to enable RS-485(%d)\n", errno);
+		return -1;
+	}
+	return 0;
 }
 
-static int open_uart(char const *path, int speed)
+static int open_uart(char const *path, struct tty_data *data)
 {
-	struct termios ios;
+	static const tcflag_t csize[] = { CS5, CS6, CS7, CS8 };
+	struct termios2 ios;
 	char buf[256];
 	int ret, fd;
 
@@ -76,80 +498,349 @@ static int open_uart(char const *path, int speed)
 	if (fd < 0)
 		return -1;
 
-	tcgetattr(fd, &ios);
+	if (ioctl(fd, TCGETS2, &ios) < 0) {
+		fprintf(stderr, "Failed to get termios configs\n");
+		goto close_fd;
+	}
+
 	memset(&ios, 0, sizeof(ios));
 	ios.c_lflag = 0;  /* disable ECHO, ICANON, etc... */
-	ios.c_cflag &= ~(CSIZE | PARENB);
-	ios.c_cflag |= (CS8 | CLOCAL | CREAD);
-	ios.c_iflag |= IGNPAR;
+	ios.c_cflag = csize[data->bits - 5] | data->parity | CLOCAL | CREAD | BOTHER;
+	if (data->cstopb)
+		ios.c_cflag |= CSTOPB;
+	if (data->flow == FLOW_RTSCTS)
+		ios.c_cflag |= CRTSCTS;
+	ios.c_iflag = data->parity ? INPCK : IGNPAR;
+	if (data->flow == FLOW_XONXOFF) {
+		ios.c_iflag |= IXON | IXOFF;
+		ios.c_cc[VSTART] = 0x11;
+		ios.c_cc[VSTOP]  = 0x13;
+	}
 	ios.c_cc[VMIN]  = 1;
 	ios.c_cc[VTIME] = 0;
+	ios.c_ispeed = data->speed;
+	ios.c_ospeed = data->speed;
 
-	if(cfsetspeed(&ios, speed) < 0) {
-		fprintf(stderr, "Failed to set baud rate\n");
-		return -1;
-	}
-
-	if (tcsetattr(fd, TCSAFLUSH, &ios) < 0) {
+	if (ioctl(fd, TCSETSF2, &ios) < 0) {
 		fprintf(stderr, "Failed to apply termios configs\n");
-		return -1;
+		goto close_fd;
 	}
 
+	/* The driver rounds the rate to what the hardware can generate */
+	if (!ioctl(fd, TCGETS2, &ios) && ios.c_ospeed != data->speed)
+		fprintf(stderr, "Baud rate %u set to %u\n",
+				data->speed, ios.c_ospeed);
+
+	if (data->low_latency)
+		set_low_latency(fd);
+
+	if (data->rs485 && set_rs485(fd, data))
+		goto close_fd;
+
 	/* empty uart socket out */
 	do {
 		ret = read(fd, buf, sizeof(buf));
 	} while (ret > 0 || (ret < 0 && errno == EINTR));
 
 	return fd;
+
+close_fd:
+	close(fd);
+	return -1;
+}
+
+/**
+ * Time in usec for the request to go out of the UART. The request may still
+ * be in the driver when it has been written to the tty, and a long one at a
+ * low baud rate would otherwise use up the response timeout by itself.
+ */
+static uint64_t xact_tx_us(struct tty_data *data)
+{
+	/* start bit, data bits, parity bit and stop bits */
+	unsigned int frame_bits = 1 + data->bits + !!data->parity +
+				(data->cstopb ? 2 : 1);
+	uint64_t us;
+
+	us = (uint64_t)data->xact_len * frame_bits * 1000000 / data->speed;
+	if (data->rs485)
+		us += data->rts_before_ms * 1000;
+	return us;
+}
+
+/**
+ * Write out bytes in tx as much as the tty accepts without blocking, and wait
+ * for the tty to be writable again if any remains.
+ */
+static void tty_write(struct rteipc_ep *self)
+{
+	struct tty_data *data = self->data;
+	struct timeval tv;
+	uint64_t us;
+	int ret;
+
+	while (evbuffer_get_length(data->tx)) {
+		ret = evbuffer_write(data->tx, data->fd);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			fprintf(stderr, "Failed to write data(%d), %zu bytes "
+					"discarded\n", errno,
+					evbuffer_get_length(data->tx));
+			evbuffer_drain(data->tx, evbuffer_get_length(data->tx));
+			/* no response to wait for, end it from the loop */
+			if (data->busy)
+				event_active(data->xtimer, EV_TIMEOUT, 0);
+			return;
+		}
+	}
+
+	if (evbuffer_get_length(data->tx)) {
+		event_add(data->wev, NULL);
+	} else if (data->busy && !evtimer_pending(data->xtimer, NULL)) {
+		/* the request is written, wait for it to go and the response */
+		us = data->xact_us + xact_tx_us(data);
+		tv.tv_sec = us / 1000000;
+		tv.tv_usec = us % 1000000;
+		evtimer_add(data->xtimer, &tv);
+	}
 }
 
 static void tty_on_data(struct rteipc_ep *self, struct bufferevent *bev)
 {
 	struct tty_data *data = self->data;
 	struct evbuffer *in = bufferevent_get_input(bev);
-	char *msg;
-	size_t len;
 	int ret;
 
-	for (;;) {
-		if (!(ret = rteipc_msg_drain(in, &len, &msg)))
+	/* Only one request at a time in transaction mode */
+	if (data->xact_us) {
+		if (data->busy)
 			return;
 
-		if (ret < 0) {
+		ret = rteipc_msg_move(in, data->tx);
+		if (ret < 0)
 			fprintf(stderr, "Error reading data\n");
+		if (ret <= 0)
 			return;
+
+		/* stale bytes are not a part of the response */
+		ioctl(data->fd, TCFLSH, TCIFLUSH);
+		evbuffer_drain(data->rx, evbuffer_get_length(data->rx));
+		data->xact_len = evbuffer_get_length(data->tx);
+		data->busy = true;
+		tty_write(self);
+		return;
+	}
+
+	/*
+	 * Messages are left in the input while tx is over txmax, and taken
+	 * again by downstream() once tx drains.
+	 */
+	while (evbuffer_get_length(data->tx) < data->txmax) {
+		if (!(ret = rteipc_msg_move(in, data->tx)))
+			break;
+
+		if (ret < 0) {
+			fprintf(stderr, "Error reading data\n");
+			break;
+		}
+	}
+
+	if (!event_pending(data->wev, EV_WRITE, NULL))
+		tty_write(self);
+}
+
+static void downstream(evutil_socket_t fd, short what, void *arg)
+{
+	struct rteipc_ep *self = arg;
+	struct tty_data *data = self->data;
+
+	tty_write(self);
+
+	if (self->bev && evbuffer_get_length(data->tx) < data->txmax)
+		tty_on_data(self, self->bev);
+}
+
+/**
+ * rteipc_tty_pending - return the number of bytes waiting to be written to
+ *                      the tty, including messages held in the endpoint
+ * @ep: TTY endpoint descriptor
+ */
+ssize_t rteipc_tty_pending(int ep)
+{
+	struct rteipc_ep *self = find_endpoint(ep);
+	struct tty_data *data;
+	size_t len;
+
+	if (!self || self->type != EP_TTY) {
+		fprintf(stderr, "Invalid tty endpoint specified\n");
+		return -1;
+	}
+
+	data = self->data;
+	len = evbuffer_get_length(data->tx);
+	if (self->bev)
+		len += evbuffer_get_length(bufferevent_get_input(self->bev));
+	return len;
+}
+
+static const struct {
+	const char *name;
+	tcflag_t cflag;
+} parity_tbl[] = {
+	{ "none",  0 },
+	{ "odd",   PARENB | PARODD },
+	{ "even",  PARENB },
+	{ "mark",  PARENB | PARODD | CMSPAR },
+	{ "space", PARENB | CMSPAR },
+};
+
+static const struct {
+	const char *name;
+	int frame;
+} frame_tbl[] = {
+	{ "line",   FRAME_LINE },
+	{ "slip",   FRAME_SLIP },
+	{ "cobs",   FRAME_COBS },
+	{ "len8",   FRAME_LEN8 },
+	{ "len16",  FRAME_LEN16 },
+	{ "fixed",  FRAME_FIXED },
+	{ "idle",   FRAME_IDLE },
+};
+
+static int parse_opts(struct tty_data *data, char *opts)
+{
+	char *key, *val, *save = NULL;
+	int i;
+
+	for (key = strtok_r(opts, ",", &save); key;
+			key = strtok_r(NULL, ",", &save)) {
+		if ((val = strchr(key, '=')))
+			*val++ = '\0';
+
+		if (!strcmp(key, "coalesce") && val) {
+			data->coalesce_us = strtoul(val, NULL, 0);
+		} else if (!strcmp(key, "chunk") && val) {
+			data->chunk = strtoul(val, NULL, 0);
+		} else if (!strcmp(key, "frame") && val) {
+			for (i = 0; i < sizeof(frame_tbl) / sizeof(frame_tbl[0]);
+					i++) {
+				if (!strcmp(frame_tbl[i].name, val))
+					data->frame = frame_tbl[i].frame;
+			}
+			if (data->frame == FRAME_RAW) {
+				fprintf(stderr, "Invalid tty frame:%s\n", val);
+				return -1;
+			}
+		} else if (!strcmp(key, "size") && val) {
+			data->frame_size = strtoul(val, NULL, 0);
+		} else if (!strcmp(key, "gap") && val) {
+			data->gap_us = strtoul(val, NULL, 0);
+		} else if (!strcmp(key, "txmax") && val) {
+			data->txmax = strtoul(val, NULL, 0);
+		} else if (!strcmp(key, "bits") && val) {
+			data->bits = strtoul(val, NULL, 0);
+			if (data->bits < 5 || data->bits > 8) {
+				fprintf(stderr, "Invalid tty bits:%s\n", val);
+				return -1;
+			}
+		} else if (!strcmp(key, "parity") && val) {
+			for (i = 0; i < sizeof(parity_tbl) / sizeof(parity_tbl[0]);
+					i++) {
+				if (!strcmp(parity_tbl[i].name, val))
+					break;
+			}
+			if (i == sizeof(parity_tbl) / sizeof(parity_tbl[0])) {
+				fprintf(stderr, "Invalid tty parity:%s\n", val);
+				return -1;
+			}
+			data->parity = parity_tbl[i].cflag;
+		} else if (!strcmp(key, "stop") && val) {
+			if (strcmp(val, "1") && strcmp(val, "2")) {
+				fprintf(stderr, "Invalid tty stop:%s\n", val);
+				return -1;
+			}
+			data->cstopb = !strcmp(val, "2");
+		} else if (!strcmp(key, "flow") && val) {
+			if (!strcmp(val, "none")) {
+				data->flow = FLOW_NONE;
+			} else if (!strcmp(val, "rtscts")) {
+				data->flow = FLOW_RTSCTS;
+			} else if (!strcmp(val, "xonxoff")) {
+				data->flow = FLOW_XONXOFF;
+			} else {
+				fprintf(stderr, "Invalid tty flow:%s\n", val);
+				return -1;
+			}
+		} else if (!strcmp(key, "low_latency") && !val) {
+			data->low_latency = true;
+		} else if (!strcmp(key, "rs485") && !val) {
+			data->rs485 = true;
+		} else if (!strcmp(key, "rts") && val) {
+			if (strcmp(val, "high") && strcmp(val, "low")) {
+				fprintf(stderr, "Invalid tty rts:%s\n", val);
+				return -1;
+			}
+			data->rts_low = !strcmp(val, "low");
+		} else if (!strcmp(key, "rts_before") && val) {
+			data->rts_before_ms = strtoul(val, NULL, 0);
+		} else if (!strcmp(key, "rts_after") && val) {
+			data->rts_after_ms = strtoul(val, NULL, 0);
+		} else if (!strcmp(key, "xact") && val) {
+			data->xact_us = strtoul(val, NULL, 0);
+		} else {
+			fprintf(stderr, "Invalid tty option:%s\n", key);
+			return -1;
 		}
+	}
+
+	if (data->chunk && !data->coalesce_us) {
+		fprintf(stderr, "chunk requires coalesce\n");
+		return -1;
+	}
+
+	if (data->frame != FRAME_RAW && data->coalesce_us) {
+		fprintf(stderr, "coalesce cannot be used with frame\n");
+		return -1;
+	}
+
+	if (data->frame == FRAME_FIXED &&
+			(!data->frame_size || data->frame_size > TTY_FRAME_MAX)) {
+		fprintf(stderr, "frame=fixed requires size up to %d\n",
+				TTY_FRAME_MAX);
+		return -1;
+	}
 
-		rteipc_msg_write(data->fd, msg, len);
-		free(msg);
+	if (data->xact_us && (data->coalesce_us ||
+			(data->frame != FRAME_RAW && data->frame != FRAME_IDLE))) {
+		fprintf(stderr, "xact can be used only with frame=idle\n");
+		return -1;
+	}
+
+	if (data->frame == FRAME_IDLE && !data->gap_us) {
+		fprintf(stderr, "frame=idle requires gap\n");
+		return -1;
 	}
+
+	if (!data->chunk)
+		data->chunk = TTY_CHUNK_DEFAULT;
+	if (!data->txmax)
+		data->txmax = TTY_TXMAX_DEFAULT;
+	if (!data->bits)
+		data->bits = 8;
+	return 0;
 }
 
 static int tty_open(struct rteipc_ep *self, const char *path)
 {
 	struct tty_data *data;
 	struct event *ev;
-	char dev[128] = {0}, baudrate[16] = {0};
-	int speed, fd;
-
-	sscanf(path, "%[^,],%[^,]", dev, baudrate);
-
-	if (!strcmp(baudrate, "921600"))
-		speed = B921600;
-	else if (!strcmp(baudrate, "576000"))
-		speed = B576000;
-	else if (!strcmp(baudrate, "500000"))
-		speed = B500000;
-	else if (!strcmp(baudrate, "460800"))
-		speed = B460800;
-	else if (!strcmp(baudrate, "230400"))
-		speed = B230400;
-	else if (!strcmp(baudrate, "115200"))
-		speed = B115200;
-	else if (!strcmp(baudrate, "57600"))
-		speed = B57600;
-	else
-		speed = B115200;
+	char dev[128] = {0}, baudrate[16] = {0}, opts[256] = {0};
+	char *end;
+	int fd;
+
+	sscanf(path, "%127[^,],%15[^,],%255[^\n]", dev, baudrate, opts);
 
 	data = malloc(sizeof(*data));
 	if (!data) {
@@ -158,26 +849,96 @@ static int tty_open(struct rteipc_ep *self, const char *path)
 	}
 
 	memset(data, 0, sizeof(*data));
-	fd = open_uart(dev, speed);
+	if (parse_opts(data, opts))
+		goto free_data;
+
+	data->speed = 115200;
+	if (*baudrate) {
+		data->speed = strtoul(baudrate, &end, 10);
+		if (*end || !data->speed) {
+			fprintf(stderr, "Invalid baud rate:%s\n", baudrate);
+			goto free_data;
+		}
+	}
+
+	data->rx = evbuffer_new();
+	data->out = evbuffer_new();
+	data->tx = evbuffer_new();
+	if (!data->rx || !data->out || !data->tx) {
+		fprintf(stderr, "Failed to allocate tty buffer\n");
+		goto free_rx;
+	}
+
+	if (data->frame == FRAME_SLIP || data->frame == FRAME_COBS) {
+		data->scratch = malloc(TTY_FRAME_MAX);
+		if (!data->scratch) {
+			fprintf(stderr, "Failed to allocate tty buffer\n");
+			goto free_rx;
+		}
+	}
+
+	if (data->coalesce_us || data->frame == FRAME_IDLE) {
+		data->timer = evtimer_new(self->base, flush_timeout, self);
+		if (!data->timer) {
+			fprintf(stderr, "Failed to create tty timer\n");
+			goto free_rx;
+		}
+	}
+
+	if (data->xact_us) {
+		data->xtimer = evtimer_new(self->base, xact_timeout, self);
+		if (!data->xtimer) {
+			fprintf(stderr, "Failed to create tty timer\n");
+			goto free_timer;
+		}
+	}
+
+	fd = open_uart(dev, data);
 	if (fd < 0) {
 		fprintf(stderr, "Failed to open tty\n");
-		free(data);
-		return -1;
+		goto free_timer;
 	}
 
 	data->fd = fd;
 	self->data = data;
 
+	data->wev = event_new(self->base, fd, EV_WRITE, downstream, self);
 	ev = event_new(self->base, fd, EV_READ | EV_PERSIST, upstream, self);
 	data->ev = ev;
 	event_add(ev, NULL);
 	return 0;
+
+free_timer:
+	if (data->xtimer)
+		event_free(data->xtimer);
+	if (data->timer)
+		event_free(data->timer);
+free_rx:
+	if (data->rx)
+		evbuffer_free(data->rx);
+	if (data->out)
+		evbuffer_free(data->out);
+	if (data->tx)
+		evbuffer_free(data->tx);
+	free(data->scratch);
+free_data:
+	free(data);
+	return -1;
 }
 
 static void tty_close(struct rteipc_ep *self)
 {
 	struct tty_data *data = self->data;
-	event_del(data->ev);
+	event_free(data->ev);
+	event_free(data->wev);
+	if (data->timer)
+		event_free(data->timer);
+	if (data->xtimer)
+		event_free(data->xtimer);
+	evbuffer_free(data->rx);
+	evbuffer_free(data->out);
+	evbuffer_free(data->tx);
+	free(data->scratch);
 	close(data->fd);
 	free(data);
 }
@@ -18,6 +18,8 @@ extern struct rteipc_ep_ops spi_ops;
 extern struct rteipc_ep_ops i2c_ops;
 extern struct rteipc_ep_ops sysfs_ops;
 extern struct rteipc_ep_ops loop_ops;
+extern struct rteipc_ep_ops iio_ops;
+extern struct rteipc_ep_ops shm_ops;
 
 struct ep_core {
 	int id;
@@ -35,13 +37,20 @@ static struct rteipc_ep_ops *ep_ops_list[] = {
 	[EP_SYSFS] = &sysfs_ops,
 	[EP_INET]  = &ipc_ops,
 	[EP_LOOP]  = &loop_ops,
+	[EP_IIO]  = &iio_ops,
+	[EP_SHM]  = &shm_ops,
 };
 
 static dtbl_t ep_tbl = DTBL_INITIALIZER(MAX_NR_EP);
 
+/* Limit of nested deliver_endpoint() calls to bound the stack usage */
+#define MAX_SYNC_DEPTH		8
+
+static __thread int sync_depth;
+
 int bind_endpoint(struct rteipc_ep *lh, struct rteipc_ep *rh,
 		bufferevent_data_cb readcb, bufferevent_data_cb writecb,
-		bufferevent_event_cb eventcb)
+		bufferevent_event_cb eventcb, bool sync)
 {
 	struct bufferevent *pair[2];
 
@@ -57,6 +66,7 @@ int bind_endpoint(struct rteipc_ep *lh, struct rteipc_ep *rh,
 
 	lh->bev = pair[0];
 	rh->bev = pair[1];
+	lh->sync = rh->sync = sync;
 	(to_core(lh))->partner_id = (to_core(rh))->id;
 	(to_core(rh))->partner_id = (to_core(lh))->id;
 	bufferevent_setcb(lh->bev, readcb, writecb, eventcb, lh);
@@ -66,6 +76,53 @@ int bind_endpoint(struct rteipc_ep *lh, struct rteipc_ep *rh,
 	return 0;
 }
 
+/**
+ * deliver_endpoint - call the read callback of the other side of @bev now
+ * @bev: bufferevent to which an endpoint has just written data
+ *
+ * A bufferevent pair always defers the read callback to the next iteration of
+ * the event loop, which adds latency at every hop. Endpoints bound with
+ * rteipc_bind_sync() get the data here instead, unless the partner is already
+ * in on_data (it picks up the data when it loops over its input, otherwise
+ * the deferred callback does) or too many deliveries are nested.
+ *
+ * The data is also left to the deferred callback when written from a thread
+ * that has not been set up by rteipc_init() with the partner's event base,
+ * since neither the partner nor its busy flag is safe to touch from there.
+ * A thread sharing the base with the loop thread must not write to a
+ * sync-bound endpoint.
+ */
+void deliver_endpoint(struct bufferevent *bev)
+{
+	struct bufferevent *peer;
+	bufferevent_data_cb readcb;
+	struct rteipc_ep *ep;
+	void *arg;
+
+	if (!(peer = bufferevent_pair_get_partner(bev)))
+		return;
+
+	bufferevent_getcb(peer, &readcb, NULL, NULL, &arg);
+	ep = arg;
+	if (!readcb || !ep || !ep->sync || ep->busy ||
+			ep->base != __base || sync_depth >= MAX_SYNC_DEPTH)
+		return;
+
+	sync_depth++;
+	readcb(peer, ep);
+	sync_depth--;
+}
+
+/**
+ * Tell the user that the process connected to an ipc, inet or shm endpoint
+ * has disconnected.
+ */
+void hangup_endpoint(struct rteipc_ep *ep)
+{
+	if (ep->hup_cb)
+		ep->hup_cb((to_core(ep))->id, ep->hup_arg);
+}
+
 struct rteipc_ep *get_partner_endpoint(struct rteipc_ep *ep)
 {
 	return find_endpoint((to_core(ep))->partner_id);
@@ -85,6 +142,7 @@ void unbind_endpoint(struct rteipc_ep *ep)
 		bufferevent_free(ep->bev);
 		bufferevent_free(partner->ep.bev);
 		ep->bev = partner->ep.bev = NULL;
+		ep->sync = partner->ep.sync = false;
 		(to_core(ep))->partner_id = partner->partner_id = -1;
 	}
 }
@@ -113,6 +171,10 @@ struct rteipc_ep *allocate_endpoint(int type)
 	ep->ops = ep_ops_list[type];
 	ep->bev = NULL;
 	ep->data = NULL;
+	ep->sync = false;
+	ep->busy = 0;
+	ep->hup_cb = NULL;
+	ep->hup_arg = NULL;
 
 	return ep;
 }
@@ -6,6 +6,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include "message.h"
+#include "ep.h"
 
 
 static ev_uint32_t msg_length(struct evbuffer *buf)
@@ -54,6 +55,60 @@ int rteipc_msg_drain(struct evbuffer *buf, size_t *size_out, char **msg_out)
 	return 1;
 }
 
+/**
+ * rteipc_msg_remove - remove a message from an evbuffer and copy it to the
+ *                     buffer supplied by caller
+ * @buf: evbuffer from which data removed
+ * @out: buffer to be filled with data
+ * @size: size of @out
+ * @size_out: message data length
+ *
+ * A message longer than @size is removed and discarded.
+ *
+ * Return 1 on success, 0 if buffer is empty, otherwise -1 on error.
+ */
+int rteipc_msg_remove(struct evbuffer *buf, void *out, size_t size,
+		size_t *size_out)
+{
+	ev_uint32_t len = msg_length(buf);
+
+	if (!len)
+		return 0;
+
+	evbuffer_drain(buf, 4);
+	if (len > size) {
+		evbuffer_drain(buf, len);
+		return -1;
+	}
+
+	evbuffer_remove(buf, out, len);
+	*size_out = len;
+
+	return 1;
+}
+
+/**
+ * rteipc_msg_move - remove a message from an evbuffer and append its data to
+ *                   @out without copying
+ * @buf: evbuffer from which data removed
+ * @out: evbuffer to which data appended
+ *
+ * Return 1 on success, 0 if buffer is empty, otherwise -1 on error.
+ */
+int rteipc_msg_move(struct evbuffer *buf, struct evbuffer *out)
+{
+	ev_uint32_t len = msg_length(buf);
+
+	if (!len)
+		return 0;
+
+	evbuffer_drain(buf, 4);
+	if (evbuffer_remove_buffer(buf, out, len) != len)
+		return -1;
+
+	return 1;
+}
+
 int rteipc_msg_write(evutil_socket_t fd, const void *data, size_t len)
 {
 	size_t offset = 0;
@@ -81,9 +136,13 @@ int rteipc_evbuffer(struct bufferevent *bev, struct evbuffer *buf)
 {
 	size_t len = evbuffer_get_length(buf);
 	size_t nl = htonl(len);
+	int ret;
 
 	evbuffer_prepend(buf, &nl, 4);
-	return bufferevent_write_buffer(bev, buf);
+	ret = bufferevent_write_buffer(bev, buf);
+	if (!ret)
+		deliver_endpoint(bev);
+	return ret;
 }
 
 int rteipc_buffer(struct bufferevent *bev, const void *data, size_t len)
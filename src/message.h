@@ -11,6 +11,11 @@
 
 int rteipc_msg_drain(struct evbuffer *buf, size_t *size_out, char **msg_out);
 
+int rteipc_msg_remove(struct evbuffer *buf, void *out, size_t size,
+		size_t *size_out);
+
+int rteipc_msg_move(struct evbuffer *buf, struct evbuffer *out);
+
 int rteipc_msg_write(evutil_socket_t fd, const void *data, size_t len);
 
 int rteipc_evbuffer(struct bufferevent *bev, struct evbuffer *buf);
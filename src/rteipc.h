@@ -12,16 +12,30 @@
 /* Deprecated. This flag is no effect. */
 #define RTEIPC_NO_EXIT_ON_ERR		(1 << 0)
 
+/* Clock of GPIO event timestamps */
+#define RTEIPC_CLOCK_MONOTONIC		0
+#define RTEIPC_CLOCK_REALTIME		1
+#define RTEIPC_CLOCK_HTE		2
+
 void rteipc_init(struct event_base *base);
 void rteipc_reinit(void);
 void rteipc_shutdown(void);
 void rteipc_dispatch(struct timeval *tv);
 
+/* Options for the thread calling rteipc_dispatch() */
+void rteipc_set_busypoll(unsigned int usec);
+int rteipc_set_sched(int cpu, int priority);
+
 int rteipc_open(const char *uri);
 void rteipc_close(int ep);
 int rteipc_bind(int ea, int eb);
+int rteipc_bind_sync(int ea, int eb);
 void rteipc_unbind(int ep);
 
+/* Called when the process connected to an ipc, inet or shm endpoint leaves */
+typedef void (*rteipc_hup_cb)(int ep, void *arg);
+int rteipc_hup_setcb(int ep, rteipc_hup_cb cb, void *arg);
+
 /**
  * A process can send data to ipc, inet, or loopback endpoint, then the data
  * will be transferred between the other endpoint bound to it.
@@ -35,6 +49,10 @@ int rteipc_connect(const char *uri);
 int rteipc_setcb(int ctx, rteipc_read_cb read_cb, rteipc_err_cb err_cb,
 			void *arg, short flag);
 
+/* Protocol spoken over the connection, cleared by rteipc_setcb() */
+int rteipc_set_proto(int ctx, unsigned int proto);
+unsigned int rteipc_get_proto(int ctx);
+
 int rteipc_send(int ctx, const void *data, size_t len);
 int rteipc_evsend(int ctx, struct evbuffer *buf);
 int rteipc_gpio_send(int ctx, uint8_t value);
@@ -43,6 +61,9 @@ int rteipc_i2c_send(int ctx, uint16_t addr, const uint8_t *data,
 int rteipc_spi_send(int ctx, const uint8_t *data, uint16_t len, bool rdmode);
 int rteipc_sysfs_send(int ctx, const char *attr, const char *newval);
 
+/* Number of bytes waiting to be written to the tty endpoint */
+ssize_t rteipc_tty_pending(int ep);
+
 /* Definitions for the loopback endpoint */
 
 typedef void (*rteipc_lo_cb)(const char *name, void *data, size_t len, void *arg);
@@ -4,12 +4,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
+#include <time.h>
 #include <getopt.h>
+#include <arpa/inet.h>
 #include <yaml.h>
 #include <b64/cencode.h>
 #include <b64/cdecode.h>
 #include "rtemgr-common.h"
+#include "rtemgrcli.h"
 
+/* Protocol of a connection that sends and receives packets in binary format */
+#define RTEMGR_PROTO_BINARY	1
 
 /**
  * Allocate new interface and return a pointer to it.
@@ -104,28 +110,28 @@ static inline int decode_base64(void *out, char *in)
 	return base64_decode_block(in, strlen(in), p, &s);
 }
 
-/**
- * Convert rtemgr_data to yaml formatted string.
- *
- * Return 0 on success, -1 on failure.
+/* yaml_write_handler_t appending output to evbuffer */
+static int write_evbuffer(void *data, unsigned char *buffer, size_t size)
+{
+	return !evbuffer_add(data, buffer, size);
+}
+
+/*
+ * Emit rtemgr_data into evbuffer. Output is streamed into @out as the emitter
+ * flushes it, so there is no limit on its size. If @with_cmd is false, only
+ * the interfaces section ("nr_intf" and "interfaces") is emitted.
  */
-int rtemgr_data_emit(const rtemgr_data *d, unsigned char *output, size_t size,
-			size_t *written)
+static int data_emit(const rtemgr_data *d, struct evbuffer *out, bool with_cmd)
 {
 	yaml_emitter_t emitter;
 	yaml_event_t event;
-	char *buf, *tmp;
-	size_t allocated = 0, block = 4096, padding = 256, estimated;
+	char num[32], *b64 = NULL;
+	size_t enc;
 	int i, j;
 
-	/* First allocate 4kb buffer */
-	allocated = block;
-	if (!(buf = malloc(allocated)))
-		return -1;
-
 	yaml_emitter_initialize(&emitter);
 
-	yaml_emitter_set_output_string(&emitter, output, size, written);
+	yaml_emitter_set_output(&emitter, write_evbuffer, out);
 
 	//- type: STREAM-START
 	yaml_stream_start_event_initialize(&event, YAML_UTF8_ENCODING);
@@ -144,6 +150,9 @@ int rtemgr_data_emit(const rtemgr_data *d, unsigned char *output, size_t size,
 	if (!yaml_emitter_emit(&emitter, &event))
 		goto error;
 
+	if (!with_cmd)
+		goto intf;
+
 	//- type: SCALAR "cmd"
 	yaml_scalar_event_initialize(&event, NULL,
 			(yaml_char_t *)YAML_STR_TAG,
@@ -175,10 +184,10 @@ int rtemgr_data_emit(const rtemgr_data *d, unsigned char *output, size_t size,
 		goto error;
 
 	//- type: SCALAR
-	snprintf(buf, allocated, "%d", d->cmd.action);
+	snprintf(num, sizeof(num), "%d", d->cmd.action);
 	yaml_scalar_event_initialize(&event, NULL,
 			(yaml_char_t *)YAML_STR_TAG,
-			(yaml_char_t *)buf, -1,
+			(yaml_char_t *)num, -1,
 			1, 0, YAML_PLAIN_SCALAR_STYLE);
 	if (!yaml_emitter_emit(&emitter, &event))
 		goto error;
@@ -192,10 +201,10 @@ int rtemgr_data_emit(const rtemgr_data *d, unsigned char *output, size_t size,
 		goto error;
 
 	//- type: SCALAR
-	snprintf(buf, allocated, "%d", d->cmd.error);
+	snprintf(num, sizeof(num), "%d", d->cmd.error);
 	yaml_scalar_event_initialize(&event, NULL,
 			(yaml_char_t *)YAML_STR_TAG,
-			(yaml_char_t *)buf, -1,
+			(yaml_char_t *)num, -1,
 			1, 0, YAML_PLAIN_SCALAR_STYLE);
 	if (!yaml_emitter_emit(&emitter, &event))
 		goto error;
@@ -231,17 +240,16 @@ int rtemgr_data_emit(const rtemgr_data *d, unsigned char *output, size_t size,
 		goto error;
 
 	//- type: SCALAR
-	estimated = (((4 * d->cmd.val.s / 3) + 3) & ~3) + padding;
-	if (d->cmd.val.v && estimated > allocated) {
-		allocated = block * ((estimated + block - 1) / block);
-		if (!(tmp = realloc(buf, allocated)))
-				goto error;
-		buf = tmp;
+	if (d->cmd.val.v) {
+		/* base64 breaks lines every 72 chars and ends with a newline */
+		enc = (d->cmd.val.s + 2) / 3 * 4;
+		if (!(b64 = malloc(enc + enc / 72 + 2)))
+			goto error;
+		encode_base64(b64, d->cmd.val.v, d->cmd.val.s);
 	}
-	encode_base64(buf, d->cmd.val.v, d->cmd.val.s);
 	yaml_scalar_event_initialize(&event, NULL,
 			(yaml_char_t *)"tag:yaml.org,2002:binary",
-			(yaml_char_t *)buf, -1,
+			(yaml_char_t *)(b64 ?: ""), -1,
 			0, 0, YAML_LITERAL_SCALAR_STYLE);
 	if (!yaml_emitter_emit(&emitter, &event))
 		goto error;
@@ -255,10 +263,10 @@ int rtemgr_data_emit(const rtemgr_data *d, unsigned char *output, size_t size,
 		goto error;
 
 	//- type: SCALAR
-	snprintf(buf, allocated, "%u", d->cmd.val.s);
+	snprintf(num, sizeof(num), "%u", d->cmd.val.s);
 	yaml_scalar_event_initialize(&event, NULL,
 			(yaml_char_t *)YAML_STR_TAG,
-			(yaml_char_t *)buf, -1,
+			(yaml_char_t *)num, -1,
 			1, 0, YAML_PLAIN_SCALAR_STYLE);
 	if (!yaml_emitter_emit(&emitter, &event))
 		goto error;
@@ -294,10 +302,10 @@ int rtemgr_data_emit(const rtemgr_data *d, unsigned char *output, size_t size,
 		goto error;
 
 	//- type: SCALAR
-	snprintf(buf, allocated, "%u", d->cmd.val.extra.addr);
+	snprintf(num, sizeof(num), "%u", d->cmd.val.extra.addr);
 	yaml_scalar_event_initialize(&event, NULL,
 			(yaml_char_t *)YAML_STR_TAG,
-			(yaml_char_t *)buf, -1,
+			(yaml_char_t *)num, -1,
 			1, 0, YAML_PLAIN_SCALAR_STYLE);
 	if (!yaml_emitter_emit(&emitter, &event))
 		goto error;
@@ -311,10 +319,10 @@ int rtemgr_data_emit(const rtemgr_data *d, unsigned char *output, size_t size,
 		goto error;
 
 	//- type: SCALAR
-	snprintf(buf, allocated, "%u", d->cmd.val.extra.rsize);
+	snprintf(num, sizeof(num), "%u", d->cmd.val.extra.rsize);
 	yaml_scalar_event_initialize(&event, NULL,
 			(yaml_char_t *)YAML_STR_TAG,
-			(yaml_char_t *)buf, -1,
+			(yaml_char_t *)num, -1,
 			1, 0, YAML_PLAIN_SCALAR_STYLE);
 	if (!yaml_emitter_emit(&emitter, &event))
 		goto error;
@@ -349,6 +357,7 @@ int rtemgr_data_emit(const rtemgr_data *d, unsigned char *output, size_t size,
 	if (!yaml_emitter_emit(&emitter, &event))
 		goto error;
 
+intf:
 	//- type: SCALAR "nr_intf"
 	yaml_scalar_event_initialize(&event, NULL,
 			(yaml_char_t *)YAML_STR_TAG,
@@ -358,10 +367,10 @@ int rtemgr_data_emit(const rtemgr_data *d, unsigned char *output, size_t size,
 		goto error;
 
 	//- type: SCALAR
-	snprintf(buf, allocated, "%d", d->nr_intf);
+	snprintf(num, sizeof(num), "%d", d->nr_intf);
 	yaml_scalar_event_initialize(&event, NULL,
 			(yaml_char_t *)YAML_STR_TAG,
-			(yaml_char_t *)buf, -1,
+			(yaml_char_t *)num, -1,
 			1, 0, YAML_PLAIN_SCALAR_STYLE);
 	if (!yaml_emitter_emit(&emitter, &event))
 		goto error;
@@ -398,10 +407,10 @@ int rtemgr_data_emit(const rtemgr_data *d, unsigned char *output, size_t size,
 			goto error;
 
 		//- type: SCALAR
-		snprintf(buf, allocated, "%d", d->interfaces[i].id);
+		snprintf(num, sizeof(num), "%d", d->interfaces[i].id);
 		yaml_scalar_event_initialize(&event, NULL,
 				(yaml_char_t *)YAML_STR_TAG,
-				(yaml_char_t *)buf, -1,
+				(yaml_char_t *)num, -1,
 				1, 0, YAML_PLAIN_SCALAR_STYLE);
 		if (!yaml_emitter_emit(&emitter, &event))
 			goto error;
@@ -415,10 +424,10 @@ int rtemgr_data_emit(const rtemgr_data *d, unsigned char *output, size_t size,
 			goto error;
 
 		//- type: SCALAR
-		snprintf(buf, allocated, "%d", d->interfaces[i].bus_type);
+		snprintf(num, sizeof(num), "%d", d->interfaces[i].bus_type);
 		yaml_scalar_event_initialize(&event, NULL,
 				(yaml_char_t *)YAML_STR_TAG,
-				(yaml_char_t *)buf, -1,
+				(yaml_char_t *)num, -1,
 				1, 0, YAML_PLAIN_SCALAR_STYLE);
 		if (!yaml_emitter_emit(&emitter, &event))
 			goto error;
@@ -432,10 +441,9 @@ int rtemgr_data_emit(const rtemgr_data *d, unsigned char *output, size_t size,
 			goto error;
 
 		//- type: SCALAR
-		snprintf(buf, allocated, "%s", d->interfaces[i].name);
 		yaml_scalar_event_initialize(&event, NULL,
 				(yaml_char_t *)YAML_STR_TAG,
-				(yaml_char_t *)buf, -1,
+				(yaml_char_t *)d->interfaces[i].name, -1,
 				0, 1, YAML_DOUBLE_QUOTED_SCALAR_STYLE);
 		if (!yaml_emitter_emit(&emitter, &event))
 			goto error;
@@ -449,10 +457,9 @@ int rtemgr_data_emit(const rtemgr_data *d, unsigned char *output, size_t size,
 			goto error;
 
 		//- type: SCALAR
-		snprintf(buf, allocated, "%s", d->interfaces[i].path);
 		yaml_scalar_event_initialize(&event, NULL,
 				(yaml_char_t *)YAML_STR_TAG,
-				(yaml_char_t *)buf, -1,
+				(yaml_char_t *)d->interfaces[i].path, -1,
 				0, 1, YAML_DOUBLE_QUOTED_SCALAR_STYLE);
 		if (!yaml_emitter_emit(&emitter, &event))
 			goto error;
@@ -466,10 +473,10 @@ int rtemgr_data_emit(const rtemgr_data *d, unsigned char *output, size_t size,
 			goto error;
 
 		//- type: SCALAR
-		snprintf(buf, allocated, "%d", d->interfaces[i].domain);
+		snprintf(num, sizeof(num), "%d", d->interfaces[i].domain);
 		yaml_scalar_event_initialize(&event, NULL,
 				(yaml_char_t *)YAML_STR_TAG,
-				(yaml_char_t *)buf, -1,
+				(yaml_char_t *)num, -1,
 				1, 0, YAML_PLAIN_SCALAR_STYLE);
 		if (!yaml_emitter_emit(&emitter, &event))
 			goto error;
@@ -483,10 +490,10 @@ int rtemgr_data_emit(const rtemgr_data *d, unsigned char *output, size_t size,
 			goto error;
 
 		//- type: SCALAR
-		snprintf(buf, allocated, "%d", d->interfaces[i].managed);
+		snprintf(num, sizeof(num), "%d", d->interfaces[i].managed);
 		yaml_scalar_event_initialize(&event, NULL,
 				(yaml_char_t *)YAML_STR_TAG,
-				(yaml_char_t *)buf, -1,
+				(yaml_char_t *)num, -1,
 				1, 0, YAML_PLAIN_SCALAR_STYLE);
 		if (!yaml_emitter_emit(&emitter, &event))
 			goto error;
@@ -500,10 +507,9 @@ int rtemgr_data_emit(const rtemgr_data *d, unsigned char *output, size_t size,
 			goto error;
 
 		//- type: SCALAR
-		snprintf(buf, allocated, "%s", d->interfaces[i].partner);
 		yaml_scalar_event_initialize(&event, NULL,
 				(yaml_char_t *)YAML_STR_TAG,
-				(yaml_char_t *)buf, -1,
+				(yaml_char_t *)d->interfaces[i].partner, -1,
 				0, 1, YAML_DOUBLE_QUOTED_SCALAR_STYLE);
 		if (!yaml_emitter_emit(&emitter, &event))
 			goto error;
@@ -535,11 +541,60 @@ int rtemgr_data_emit(const rtemgr_data *d, unsigned char *output, size_t size,
 		goto error;
 
 	yaml_emitter_delete(&emitter);
+	free(b64);
 	return 0;
 
 error:
 	yaml_emitter_delete(&emitter);
-	free(buf);
+	free(b64);
+	return -1;
+}
+
+/**
+ * Convert rtemgr_data to yaml formatted string and append it to evbuffer.
+ *
+ * Return 0 on success, -1 on failure.
+ */
+int rtemgr_data_emit(const rtemgr_data *d, struct evbuffer *out)
+{
+	return data_emit(d, out, true);
+}
+
+/**
+ * Append only the interfaces section of rtemgr_data in yaml format to
+ * evbuffer. Put after the data before the section of a packet (see
+ * rtemgr_data_intf_offset()), it replaces the interfaces of the packet.
+ *
+ * Return 0 on success, -1 on failure.
+ */
+int rtemgr_data_emit_intf(const rtemgr_data *d, struct evbuffer *out)
+{
+	return data_emit(d, out, false);
+}
+
+/**
+ * Return the offset of the interfaces section that rtemgr_data_emit() puts
+ * at the end of a packet, or -1 if not found. It is searched backwards
+ * within RTEMGR_INTF_SECTION_MAX bytes so that the cost does not depend on
+ * the size of data before it.
+ */
+ssize_t rtemgr_data_intf_offset(const void *input, size_t size)
+{
+	static const char key[] = "\nnr_intf:";
+	const char *p = input;
+	size_t n = sizeof(key) - 1;
+	ssize_t i, end = 0;
+
+	if (size < n)
+		return -1;
+
+	if (size > RTEMGR_INTF_SECTION_MAX)
+		end = size - RTEMGR_INTF_SECTION_MAX;
+
+	for (i = size - n; i >= end; i--) {
+		if (p[i] == '\n' && !memcmp(p + i, key, n))
+			return i + 1;
+	}
 	return -1;
 }
 
@@ -798,45 +853,408 @@ error:
 	return NULL;
 }
 
-static inline int
-__rtemgr_encode_domain(int domain, const char *name, const struct rtecmd *cmd,
-			void **out, size_t *len)
+/**
+ * Return true if data is a packet in binary format.
+ */
+bool rtemgr_bin_match(const void *input, size_t size)
 {
-	rtemgr_data *d;
-	rtemgr_intf *intf;
-	unsigned char *buf;
-	size_t bufsz, written;
+	return size >= sizeof(struct rtemgr_bin_hdr) &&
+		!memcmp(input, RTEMGR_BIN_MAGIC, 4);
+}
 
-	d = rtemgr_data_alloc();
-	if (!d)
+/**
+ * Append rtemgr_data in binary format to evbuffer. Only the first interface
+ * is taken, which is the destination or sender of data.
+ *
+ * Return 0 on success, -1 on failure.
+ */
+int rtemgr_bin_emit(const rtemgr_data *d, struct evbuffer *out)
+{
+	const rtemgr_intf *intf = d->interfaces;
+	struct rtemgr_bin_hdr hdr;
+	size_t name_len = 0;
+
+	if (d->cmd.val.s > UINT32_MAX)
 		return -1;
 
-	intf = rtemgr_data_alloc_interface(d);
-	if (!intf)
-		goto free;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, RTEMGR_BIN_MAGIC, sizeof(hdr.magic));
+	hdr.action = d->cmd.action;
+	hdr.error = d->cmd.error;
+	hdr.bus_type = intf ? intf->bus_type : -1;
+	hdr.addr = htons(d->cmd.val.extra.addr);
+	hdr.rsize = htons(d->cmd.val.extra.rsize);
+	hdr.len = htonl(d->cmd.val.s);
+	if (intf) {
+		name_len = strnlen(intf->name, sizeof(intf->name) - 1);
+		hdr.name_len = name_len;
+		hdr.domain = htons(intf->domain);
+	}
 
-	memcpy(&d->cmd, cmd, sizeof(*cmd));
-	d->cmd.action = RTECMD_XFER;
-	intf->domain = domain;
-	strncpy(intf->name, name, sizeof(intf->name));
+	if (evbuffer_add(out, &hdr, sizeof(hdr)) ||
+			(name_len && evbuffer_add(out, intf->name, name_len)) ||
+			(d->cmd.val.s &&
+			 evbuffer_add(out, d->cmd.val.v, d->cmd.val.s)))
+		return -1;
+	return 0;
+}
 
-	bufsz = cmd->val.s * 3 / 2;
-	if (bufsz < 512)
-		bufsz = 512;
+/**
+ * Parse a packet in binary format into rtemgr_data and rtemgr_intf supplied
+ * by caller. Nothing is allocated, cmd.val.v points to data in @input, so
+ * that rtemgr_data_free() must not be called with @d.
+ *
+ * Return 0 on success, -1 on failure.
+ */
+int rtemgr_bin_parse(const void *input, size_t size, rtemgr_data *d,
+			rtemgr_intf *intf)
+{
+	const uint8_t *p = input;
+	struct rtemgr_bin_hdr hdr;
+	size_t len;
 
-	buf = malloc(bufsz);
-	if (!buf)
-		goto free;
+	if (!rtemgr_bin_match(input, size))
+		return -1;
 
-	if (rtemgr_data_emit(d, buf, bufsz, &written))
-		goto free;
+	memcpy(&hdr, p, sizeof(hdr));
+	len = ntohl(hdr.len);
+	if (hdr.name_len >= sizeof(intf->name) ||
+			size != sizeof(hdr) + hdr.name_len + len)
+		return -1;
+	p += sizeof(hdr);
+
+	memset(intf, 0, sizeof(*intf));
+	intf->id = -1;
+	intf->bus_type = hdr.bus_type;
+	intf->domain = ntohs(hdr.domain);
+	memcpy(intf->name, p, hdr.name_len);
+	p += hdr.name_len;
+
+	memset(d, 0, sizeof(*d));
+	d->cmd.action = hdr.action;
+	d->cmd.error = hdr.error;
+	d->cmd.val.v = len ? (void *)p : NULL;
+	d->cmd.val.s = len;
+	d->cmd.val.extra.addr = ntohs(hdr.addr);
+	d->cmd.val.extra.rsize = ntohs(hdr.rsize);
+	d->nr_intf = 1;
+	d->interfaces = intf;
+	return 0;
+}
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/* Value of a hex digit plus one, 0 for other characters */
+static const uint8_t hex_values[256] = {
+	['0'] = 1,  ['1'] = 2,  ['2'] = 3,  ['3'] = 4,  ['4'] = 5,
+	['5'] = 6,  ['6'] = 7,  ['7'] = 8,  ['8'] = 9,  ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+static inline bool is_hex_sep(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n';
+}
+
+/**
+ * Write @len bytes of @src to @dst as hex strings separated by a space,
+ * e.g. "0x01 0xff", which takes RTEMGR_HEX_LEN(len) bytes. No terminator is
+ * written. Return the length written.
+ */
+size_t rtemgr_hex_encode(char *dst, const void *src, size_t len)
+{
+	const uint8_t *p = src;
+	char *q = dst;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		*q++ = '0';
+		*q++ = 'x';
+		*q++ = hex_digits[p[i] >> 4];
+		*q++ = hex_digits[p[i] & 0xf];
+		*q++ = ' ';
+	}
+	/* No trailing space */
+	return len ? q - dst - 1 : 0;
+}
 
-	*out = buf;
-	*len = written;
+/**
+ * Parse hex strings separated by spaces in @src of @len bytes, each may be
+ * prefixed with "0x", into @dst that has room for (len + 1) / 2 bytes.
+ * As strtoul() does, a string is parsed up to a non-hex character and only
+ * the lowest byte of its value is taken. Return the number of bytes parsed.
+ */
+size_t rtemgr_hex_decode(uint8_t *dst, const char *src, size_t len)
+{
+	const char *end = src + len;
+	size_t n = 0;
+	uint8_t val, digit;
+
+	while (src < end) {
+		if (is_hex_sep(*src)) {
+			src++;
+			continue;
+		}
+
+		if (end - src > 2 && src[0] == '0' &&
+				(src[1] == 'x' || src[1] == 'X') &&
+				hex_values[(uint8_t)src[2]])
+			src += 2;
+
+		for (val = 0; src < end &&
+				(digit = hex_values[(uint8_t)*src]); src++)
+			val = val << 4 | (digit - 1);
+		dst[n++] = val;
+
+		/* Ignore the rest of the string */
+		while (src < end && !is_hex_sep(*src))
+			src++;
+	}
+	return n;
+}
+
+/**
+ * Append data received from an interface to evbuffer in human readable form,
+ * a line per message: a byte array for I2C, SPI and IIO, a transition with
+ * its timestamp for GPIO, otherwise data as it is.
+ *
+ * Return 0 on success, -1 on failure.
+ */
+int rtemgr_data_format(int bus_type, const void *msg, size_t len,
+			struct evbuffer *out)
+{
+	const uint8_t *p_arg;
+	struct evbuffer_iovec v;
+	struct tm *tm;
+	time_t t;
+	uint64_t tv_sec, tv_nsec, event_ns, sent_ns;
+	uint8_t value, clock;
+	char dstr[64], *p;
+
+	if (bus_type == EP_I2C || bus_type == EP_SPI || bus_type == EP_IIO) {
+		/* "[ 0x01 0x02 ]\n" written at once */
+		if (evbuffer_reserve_space(out, len * 5 + 4, &v, 1) < 1)
+			return -1;
+		p = v.iov_base;
+		*p++ = '[';
+		*p++ = ' ';
+		if (len) {
+			p += rtemgr_hex_encode(p, msg, len);
+			*p++ = ' ';
+		}
+		*p++ = ']';
+		*p++ = '\n';
+		v.iov_len = p - (char *)v.iov_base;
+		if (evbuffer_commit_space(out, &v, 1))
+			return -1;
+	} else if (bus_type == EP_GPIO &&
+			len == sizeof(uint8_t) * 2 + sizeof(uint64_t) * 2) {
+		/* 'ts=ns' format */
+		p_arg = msg;
+		value = *p_arg++;
+		clock = *p_arg++;
+		memcpy(&event_ns, p_arg, sizeof(event_ns));
+		p_arg += sizeof(event_ns);
+		memcpy(&sent_ns, p_arg, sizeof(sent_ns));
+		tv_sec = event_ns / 1000000000;
+		tv_nsec = event_ns % 1000000000;
+		if (clock == RTEIPC_CLOCK_REALTIME) {
+			t = tv_sec;
+			tm = localtime(&t);
+			strftime(dstr, sizeof(dstr), "%Y-%m-%d %H:%M:%S", tm);
+		} else {
+			snprintf(dstr, sizeof(dstr), "%" PRIu64, tv_sec);
+		}
+		evbuffer_add_printf(out,
+				"[%s.%09" PRIu64 "] %s ==> %s (+%" PRIu64 "ns)\n",
+				dstr, tv_nsec,
+				!value ? "Hi" : "Lo",
+				value ? "Hi" : "Lo",
+				sent_ns - event_ns);
+	} else if (bus_type == EP_GPIO) {
+		if (len < sizeof(uint8_t) + sizeof(uint64_t) * 2)
+			return -1;
+		p_arg = msg;
+		value = *p_arg++;
+		memcpy(&tv_sec, p_arg, sizeof(tv_sec));
+		p_arg += sizeof(uint64_t);
+		memcpy(&tv_nsec, p_arg, sizeof(tv_nsec));
+		t = tv_sec;
+		tm = localtime(&t);
+		strftime(dstr, sizeof(dstr), "%Y-%m-%d %H:%M:%S", tm);
+		evbuffer_add_printf(out, "[%s.%06" PRIu64 "] %s ==> %s\n",
+				dstr, tv_nsec,
+				!value ? "Hi" : "Lo",
+				value ? "Hi" : "Lo");
+	} else {
+		evbuffer_add_printf(out, "%.*s\n", (int)len, (const char *)msg);
+	}
 	return 0;
-free:
-	rtemgr_data_free(d);
-	return -1;
+}
+
+static inline bool is_bin_ctx(int ctx)
+{
+	return rteipc_get_proto(ctx) == RTEMGR_PROTO_BINARY;
+}
+
+/**
+ * Send a managed packet in binary format.
+ */
+static int bin_send(int ctx, int action, int domain, const char *name,
+			const void *data, size_t len, uint16_t addr,
+			uint16_t rsize)
+{
+	rtemgr_data d = {0};
+	rtemgr_intf intf = {0};
+	struct evbuffer *buf;
+	int err = -1;
+
+	if (!(buf = evbuffer_new()))
+		return -1;
+
+	intf.bus_type = -1;
+	intf.domain = domain;
+	strncpy(intf.name, name, sizeof(intf.name) - 1);
+	d.cmd.action = action;
+	d.cmd.val.v = (void *)data;
+	d.cmd.val.s = len;
+	d.cmd.val.extra.addr = addr;
+	d.cmd.val.extra.rsize = rsize;
+	d.nr_intf = 1;
+	d.interfaces = &intf;
+
+	if (!rtemgr_bin_emit(&d, buf))
+		err = rteipc_evsend(ctx, buf);
+	evbuffer_free(buf);
+	return err;
+}
+
+int rtemgr_use_binary(int ctx)
+{
+	if (bin_send(ctx, RTECMD_HELLO, DOMAIN_RTEMGR, "", NULL, 0, 0, 0))
+		return -1;
+
+	return rteipc_set_proto(ctx, RTEMGR_PROTO_BINARY);
+}
+
+/**
+ * Append a managed packet for data in cmd to evbuffer in YAML format.
+ * cmd.val.v is only referenced, not freed.
+ */
+static int encode_evbuffer(int domain, const char *name,
+			const struct rtecmd *cmd, struct evbuffer *out)
+{
+	rtemgr_data d = {0};
+	rtemgr_intf intf = {0};
+
+	memcpy(&d.cmd, cmd, sizeof(*cmd));
+	d.cmd.action = RTECMD_XFER;
+	intf.domain = domain;
+	strncpy(intf.name, name, sizeof(intf.name) - 1);
+	d.nr_intf = 1;
+	d.interfaces = &intf;
+	return rtemgr_data_emit(&d, out);
+}
+
+/* Encode a managed packet into memory the caller must free */
+static int encode_mem(int domain, const char *name, const struct rtecmd *cmd,
+			void **out, size_t *written)
+{
+	struct evbuffer *buf;
+	size_t len;
+	int err = -1;
+
+	if (!(buf = evbuffer_new()))
+		return -1;
+
+	if (!encode_evbuffer(domain, name, cmd, buf)) {
+		len = evbuffer_get_length(buf);
+		if ((*out = malloc(len))) {
+			evbuffer_remove(buf, *out, len);
+			*written = len;
+			err = 0;
+		}
+	}
+	evbuffer_free(buf);
+	return err;
+}
+
+/* Encode a managed packet and send it to ctx */
+static int encode_send(int ctx, int domain, const char *name,
+			const struct rtecmd *cmd)
+{
+	struct evbuffer *buf;
+	int err = -1;
+
+	if (!(buf = evbuffer_new()))
+		return -1;
+
+	if (!encode_evbuffer(domain, name, cmd, buf))
+		err = rteipc_evsend(ctx, buf);
+	evbuffer_free(buf);
+	return err;
+}
+
+/*
+ * Set value of cmd to data formatted in @hex, which must be kept until cmd is
+ * encoded.
+ */
+static int hex_val(struct rtecmd *cmd, struct evbuffer *hex,
+			const uint8_t *data, uint16_t len)
+{
+	struct evbuffer_iovec v;
+
+	if (evbuffer_reserve_space(hex, RTEMGR_HEX_LEN(len), &v, 1) < 1)
+		return -1;
+	v.iov_len = rtemgr_hex_encode(v.iov_base, data, len);
+	if (evbuffer_commit_space(hex, &v, 1))
+		return -1;
+
+	/* In a single chunk, no copy */
+	cmd->val.s = v.iov_len;
+	cmd->val.v = evbuffer_pullup(hex, cmd->val.s);
+	return cmd->val.v ? 0 : -1;
+}
+
+/*
+ * Set up cmd for SPI data formatted in @hex, which must be kept until cmd is
+ * encoded.
+ */
+static int spi_cmd(struct rtecmd *cmd, struct evbuffer *hex,
+			const uint8_t *data, uint16_t len, bool rdmode)
+{
+	if (!data || !len)
+		return -1;
+
+	cmd->val.extra.rsize = rdmode ? len : 0;
+	return hex_val(cmd, hex, data, len);
+}
+
+/*
+ * Set up cmd for I2C data formatted in @hex, which must be kept until cmd is
+ * encoded.
+ */
+static int i2c_cmd(struct rtecmd *cmd, struct evbuffer *hex, uint16_t addr,
+			const uint8_t *data, uint16_t wlen, uint16_t rlen)
+{
+	if (!wlen && !rlen || (wlen && !data))
+		return -1;
+
+	if (wlen && hex_val(cmd, hex, data, wlen))
+		return -1;
+	cmd->val.extra.addr = addr;
+	cmd->val.extra.rsize = rlen;
+	return 0;
+}
+
+static void sysfs_arg(char *buf, size_t size, const char *attr,
+			const char *newval)
+{
+	if (newval)
+		snprintf(buf, size, "%s=%s", attr, newval);
+	else
+		snprintf(buf, size, "%s", attr);
 }
 
 int rtemgr_encode_domain(int domain, const char *name, const void *data,
@@ -847,11 +1265,8 @@ int rtemgr_encode_domain(int domain, const char *name, const void *data,
 	if (!data || !len)
 		return -1;
 	cmd.val.s = len;
-	cmd.val.v = malloc(len);
-	if (!cmd.val.v)
-		return -1;
-	memcpy(cmd.val.v, data, len);
-	return __rtemgr_encode_domain(domain, name, &cmd, out, written);
+	cmd.val.v = (void *)data;
+	return encode_mem(domain, name, &cmd, out, written);
 }
 
 int rtemgr_gpio_encode_domain(int domain, const char *name, uint8_t value,
@@ -866,29 +1281,16 @@ int rtemgr_spi_encode_domain(int domain, const char *name,
 			void **out, size_t *written)
 {
 	struct rtecmd cmd = {0};
-	struct evbuffer *buf;
-	int i;
+	struct evbuffer *hex;
+	int err = -1;
 
-	if (!data || !len)
+	if (!(hex = evbuffer_new()))
 		return -1;
 
-	buf = evbuffer_new();
-	if (!buf)
-		return -1;
-
-	for (i = 0; i < len; i++)
-		evbuffer_add_printf(buf, "0x%02x ", data[i]);
-
-	cmd.val.s = evbuffer_get_length(buf) - 1;
-	cmd.val.v = malloc(cmd.val.s);
-	if (!cmd.val.v) {
-		evbuffer_free(buf);
-		return -1;
-	}
-	cmd.val.extra.rsize = rdmode ? len : 0;
-	evbuffer_remove(buf, cmd.val.v, cmd.val.s);
-	evbuffer_free(buf);
-	return __rtemgr_encode_domain(domain, name, &cmd, out, written);
+	if (!spi_cmd(&cmd, hex, data, len, rdmode))
+		err = encode_mem(domain, name, &cmd, out, written);
+	evbuffer_free(hex);
+	return err;
 }
 
 int rtemgr_i2c_encode_domain(int domain, const char *name, uint16_t addr,
@@ -896,50 +1298,27 @@ int rtemgr_i2c_encode_domain(int domain, const char *name, uint16_t addr,
 			void **out, size_t *written)
 {
 	struct rtecmd cmd = {0};
-	struct evbuffer *buf;
-	int i;
+	struct evbuffer *hex;
+	int err = -1;
 
-	if (!wlen && !rlen || (wlen && !data))
-		return -1;
-
-	buf = evbuffer_new();
-	if (!buf)
+	if (!(hex = evbuffer_new()))
 		return -1;
 
-	for (i = 0; i < wlen; i++)
-		evbuffer_add_printf(buf, "0x%02x ", data[i]);
-
-	if (evbuffer_get_length(buf))
-		cmd.val.s = evbuffer_get_length(buf) - 1;
-
-	if (cmd.val.s) {
-		cmd.val.v = malloc(cmd.val.s);
-		if (!cmd.val.v) {
-			evbuffer_free(buf);
-			return -1;
-		}
-		evbuffer_remove(buf, cmd.val.v, cmd.val.s);
-	}
-	cmd.val.extra.addr = addr;
-	cmd.val.extra.rsize = rlen;
-	evbuffer_free(buf);
-	return __rtemgr_encode_domain(domain, name, &cmd, out, written);
+	if (!i2c_cmd(&cmd, hex, addr, data, wlen, rlen))
+		err = encode_mem(domain, name, &cmd, out, written);
+	evbuffer_free(hex);
+	return err;
 }
 
 int rtemgr_sysfs_encode_domain(int domain, const char *name, const char *attr,
 			const char *newval, void **out, size_t *written)
 {
-	struct rtecmd cmd = {0};
 	char buf[256];
 
 	if (!attr)
 		return -1;
 
-	if (newval)
-		snprintf(buf, sizeof(buf), "%s=%s", attr, newval);
-	else
-		snprintf(buf, sizeof(buf), "%s", attr);
-
+	sysfs_arg(buf, sizeof(buf), attr, newval);
 	return rtemgr_encode_domain(domain, name, buf, strlen(buf),
 				out, written);
 }
@@ -947,68 +1326,133 @@ int rtemgr_sysfs_encode_domain(int domain, const char *name, const char *attr,
 int rtemgr_send_domain(int ctx, int domain, const char *name,
 			const void *data, size_t len)
 {
-	void *out;
-	size_t written;
-	int err;
-
-	err = rtemgr_encode_domain(domain, name, data, len, &out, &written);
-	if (err)
-		return err;
-	return rteipc_send(ctx, out, written);
+	struct rtecmd cmd = {0};
+
+	if (!data || !len)
+		return -1;
+
+	if (is_bin_ctx(ctx))
+		return bin_send(ctx, RTECMD_XFER, domain, name, data, len,
+				0, 0);
+
+	cmd.val.s = len;
+	cmd.val.v = (void *)data;
+	return encode_send(ctx, domain, name, &cmd);
 }
 
 int rtemgr_gpio_send_domain(int ctx, int domain, const char *name,
 			uint8_t value)
 {
+	uint8_t v = !!value;
+
+	if (is_bin_ctx(ctx))
+		return bin_send(ctx, RTECMD_XFER, domain, name, &v, 1, 0, 0);
+
 	return rtemgr_send_domain(ctx, domain, name, value ? "1" : "0", 1);
 }
 
 int rtemgr_spi_send_domain(int ctx, int domain, const char *name,
 			const uint8_t *data, uint16_t len, bool rdmode)
 {
-	void *out;
-	size_t written;
-	int err;
-
-	err = rtemgr_spi_encode_domain(domain, name, data, len, rdmode,
-			&out, &written);
-	if (err)
-		return err;
-	return rteipc_send(ctx, out, written);
+	struct rtecmd cmd = {0};
+	struct evbuffer *hex;
+	int err = -1;
+
+	if (is_bin_ctx(ctx)) {
+		if (!data || !len)
+			return -1;
+		return bin_send(ctx, RTECMD_XFER, domain, name, data, len,
+				0, rdmode ? len : 0);
+	}
+
+	if (!(hex = evbuffer_new()))
+		return -1;
+
+	if (!spi_cmd(&cmd, hex, data, len, rdmode))
+		err = encode_send(ctx, domain, name, &cmd);
+	evbuffer_free(hex);
+	return err;
 }
 
 int rtemgr_i2c_send_domain(int ctx, int domain, const char *name,
 			uint16_t addr, const uint8_t *data, uint16_t wlen,
 			uint16_t rlen)
 {
-	void *out;
-	size_t written;
-	int err;
-
-	err = rtemgr_i2c_encode_domain(domain, name, addr, data, wlen, rlen,
-			&out, &written);
-	if (err)
-		return err;
-	return rteipc_send(ctx, out, written);
+	struct rtecmd cmd = {0};
+	struct evbuffer *hex;
+	int err = -1;
+
+	if (is_bin_ctx(ctx)) {
+		if (!wlen && !rlen || (wlen && !data))
+			return -1;
+		return bin_send(ctx, RTECMD_XFER, domain, name, data, wlen,
+				addr, rlen);
+	}
+
+	if (!(hex = evbuffer_new()))
+		return -1;
+
+	if (!i2c_cmd(&cmd, hex, addr, data, wlen, rlen))
+		err = encode_send(ctx, domain, name, &cmd);
+	evbuffer_free(hex);
+	return err;
 }
 
 int rtemgr_sysfs_send_domain(int ctx, int domain, const char *name,
 			const char *attr, const char *newval)
 {
-	void *out;
-	size_t written;
-	int err;
-
-	err = rtemgr_sysfs_encode_domain(domain, name, attr, newval,
-			&out, &written);
-	if (err)
-		return err;
-	return rteipc_send(ctx, out, written);
+	char buf[256];
+
+	if (!attr)
+		return -1;
+
+	sysfs_arg(buf, sizeof(buf), attr, newval);
+	if (is_bin_ctx(ctx))
+		return bin_send(ctx, RTECMD_XFER, domain, name, buf,
+				strlen(buf), 0, 0);
+
+	return rtemgr_send_domain(ctx, domain, name, buf, strlen(buf));
+}
+
+/**
+ * Copy a packet in binary format into rtemgr_data allocated, so that it can
+ * be released by rtemgr_put_dh() same as YAML.
+ */
+static rtemgr_data *bin_decode(const unsigned char *data, size_t len)
+{
+	rtemgr_data bin, *d;
+	rtemgr_intf intf, *p;
+
+	if (rtemgr_bin_parse(data, len, &bin, &intf))
+		return NULL;
+
+	if (!(d = rtemgr_data_alloc()))
+		return NULL;
+
+	if (!(p = rtemgr_data_alloc_interface(d)))
+		goto free;
+	memcpy(p, &intf, sizeof(intf));
+	memcpy(&d->cmd, &bin.cmd, sizeof(bin.cmd));
+	d->cmd.val.v = NULL;
+	if (bin.cmd.val.s) {
+		if (!(d->cmd.val.v = malloc(bin.cmd.val.s)))
+			goto free;
+		memcpy(d->cmd.val.v, bin.cmd.val.v, bin.cmd.val.s);
+	}
+	return d;
+free:
+	rtemgr_data_free(d);
+	return NULL;
 }
 
 rtemgr_data *rtemgr_decode(const unsigned char *data, size_t len)
 {
-	rtemgr_data *d = rtemgr_data_parse(data, len);
+	rtemgr_data *d;
+
+	if (rtemgr_bin_match(data, len))
+		return bin_decode(data, len);
+
+	d = rtemgr_data_parse(data, len);
 	if (!d || !d->interfaces)
 		return NULL;
 	return d;
@@ -0,0 +1,302 @@
+// Copyright (c) 2021 Ryosuke Saito All rights reserved.
+// MIT licensed
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include "message.h"
+#include "pending.h"
+
+
+/* A message in the spill ring is a 4-byte length followed by data */
+struct pending_spill {
+	uint8_t *map;
+	size_t size;
+	size_t head;     /* offset of the oldest message */
+	size_t used;     /* bytes in use */
+	size_t nr_msgs;
+};
+
+static struct pending_spill *spill_new(const char *dir, size_t size)
+{
+	struct pending_spill *sp;
+	char path[PATH_MAX];
+	void *map;
+	int fd, err;
+
+	snprintf(path, sizeof(path), "%s/rtemgrd-pending-XXXXXX", dir);
+	fd = mkstemp(path);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to create spill file in %s\n", dir);
+		return NULL;
+	}
+	/* The ring lives as long as it is mapped */
+	unlink(path);
+
+	/* Reserve blocks now rather than getting SIGBUS on a full disk */
+	if ((err = posix_fallocate(fd, 0, size))) {
+		fprintf(stderr, "Failed to allocate spill file: %s\n",
+				strerror(err));
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Failed to map spill file\n");
+		return NULL;
+	}
+
+	if (!(sp = calloc(1, sizeof(*sp)))) {
+		munmap(map, size);
+		return NULL;
+	}
+	sp->map = map;
+	sp->size = size;
+	return sp;
+}
+
+static void spill_free(struct pending_spill *sp)
+{
+	munmap(sp->map, sp->size);
+	free(sp);
+}
+
+static void spill_write(struct pending_spill *sp, size_t off,
+			const void *src, size_t n)
+{
+	size_t first;
+
+	off %= sp->size;
+	first = (n < sp->size - off) ? n : sp->size - off;
+	memcpy(sp->map + off, src, first);
+	memcpy(sp->map, (const uint8_t *)src + first, n - first);
+}
+
+static void spill_read(struct pending_spill *sp, size_t off, void *dst,
+			size_t n)
+{
+	size_t first;
+
+	off %= sp->size;
+	first = (n < sp->size - off) ? n : sp->size - off;
+	memcpy(dst, sp->map + off, first);
+	memcpy((uint8_t *)dst + first, sp->map, n - first);
+}
+
+static int spill_push(struct pending_spill *sp, const void *data, uint32_t len)
+{
+	size_t tail = sp->head + sp->used;
+
+	if (sizeof(len) + len > sp->size - sp->used)
+		return -1;
+
+	spill_write(sp, tail, &len, sizeof(len));
+	spill_write(sp, tail + sizeof(len), data, len);
+	sp->used += sizeof(len) + len;
+	sp->nr_msgs++;
+	return 0;
+}
+
+static uint32_t spill_peek(struct pending_spill *sp)
+{
+	uint32_t len;
+
+	spill_read(sp, sp->head, &len, sizeof(len));
+	return len;
+}
+
+static void spill_drop(struct pending_spill *sp)
+{
+	size_t n = sizeof(uint32_t) + spill_peek(sp);
+
+	sp->head = (sp->head + n) % sp->size;
+	sp->used -= n;
+	sp->nr_msgs--;
+}
+
+static inline bool spill_empty(struct pending *q)
+{
+	return !q->spill || !q->spill->nr_msgs;
+}
+
+static bool mem_fits(struct pending *q, size_t len)
+{
+	const struct pending_conf *conf = q->conf;
+	size_t used = evbuffer_get_length(q->buf);
+
+	return (!conf->max_bytes || used + 4 + len <= conf->max_bytes) &&
+		(!conf->max_msgs || q->nr_msgs < conf->max_msgs);
+}
+
+static int mem_push(struct pending *q, const void *data, uint32_t len)
+{
+	uint32_t nl = htonl(len);
+
+	if (evbuffer_expand(q->buf, sizeof(nl) + len) ||
+			evbuffer_add(q->buf, &nl, sizeof(nl)) ||
+			evbuffer_add(q->buf, data, len))
+		return -1;
+	q->nr_msgs++;
+	return 0;
+}
+
+static void mem_drop(struct pending *q)
+{
+	uint32_t nl;
+
+	evbuffer_copyout(q->buf, &nl, sizeof(nl));
+	evbuffer_drain(q->buf, sizeof(nl) + ntohl(nl));
+	q->nr_msgs--;
+}
+
+/* Move the oldest messages in the spill ring to memory while they fit */
+static void refill(struct pending *q)
+{
+	struct pending_spill *sp = q->spill;
+	struct evbuffer_iovec v;
+	uint32_t len, nl;
+
+	while (!spill_empty(q) && mem_fits(q, len = spill_peek(sp))) {
+		if (evbuffer_reserve_space(q->buf, sizeof(nl) + len, &v, 1) < 1)
+			return;
+		nl = htonl(len);
+		memcpy(v.iov_base, &nl, sizeof(nl));
+		spill_read(sp, sp->head + sizeof(nl),
+			   (uint8_t *)v.iov_base + sizeof(nl), len);
+		v.iov_len = sizeof(nl) + len;
+		if (evbuffer_commit_space(q->buf, &v, 1))
+			return;
+		q->nr_msgs++;
+		spill_drop(sp);
+	}
+}
+
+/* Return true if the spill ring is available, created on first use */
+static bool spill_ready(struct pending *q)
+{
+	const struct pending_conf *conf = q->conf;
+
+	if (q->spill)
+		return true;
+	if (!conf->spill_dir || q->spill_failed)
+		return false;
+	if (!(q->spill = spill_new(conf->spill_dir, conf->spill_size)))
+		q->spill_failed = true;
+	return !!q->spill;
+}
+
+/* Drop the oldest message, return -1 if there is nothing to drop */
+static int drop_oldest(struct pending *q)
+{
+	if (q->nr_msgs)
+		mem_drop(q);
+	else if (!spill_empty(q))
+		spill_drop(q->spill);
+	else
+		return -1;
+	refill(q);
+	return 0;
+}
+
+int pending_init(struct pending *q, const struct pending_conf *conf)
+{
+	memset(q, 0, sizeof(*q));
+	q->conf = conf;
+	q->buf = evbuffer_new();
+	return q->buf ? 0 : -1;
+}
+
+void pending_release(struct pending *q)
+{
+	if (q->buf)
+		evbuffer_free(q->buf);
+	if (q->spill)
+		spill_free(q->spill);
+	memset(q, 0, sizeof(*q));
+}
+
+/**
+ * Queue a message, dropping one per the drop policy if the queue is full.
+ *
+ * Return 0 if queued without dropping, 1 if a message was dropped, otherwise
+ * -1 on error.
+ */
+int pending_push(struct pending *q, const void *data, size_t len)
+{
+	const struct pending_conf *conf = q->conf;
+	bool fits_mem, fits_spill;
+	int dropped = 0;
+
+	/* An empty message would read as the end of the queue */
+	if (!len)
+		return 0;
+
+	if (len > UINT32_MAX - sizeof(uint32_t))
+		goto drop;
+
+	/* Never fits even in the empty queue */
+	fits_mem = !conf->max_bytes || 4 + len <= conf->max_bytes;
+	fits_spill = conf->spill_dir && 4 + len <= conf->spill_size;
+	if (!fits_mem && !fits_spill)
+		goto drop;
+
+	for (;;) {
+		if (spill_empty(q) && mem_fits(q, len))
+			return mem_push(q, data, len) ? -1 : dropped;
+
+		if (fits_spill && spill_ready(q) &&
+				!spill_push(q->spill, data, len))
+			return dropped;
+
+		if (conf->drop_new || drop_oldest(q))
+			goto drop;
+
+		dropped = 1;
+		q->dropped++;
+	}
+
+drop:
+	q->dropped++;
+	return 1;
+}
+
+/**
+ * Remove the oldest message from the queue, which must be free()ed by caller.
+ *
+ * Return 1 on success, 0 if the queue is empty, otherwise -1 on error.
+ */
+int pending_pop(struct pending *q, size_t *size_out, char **msg_out)
+{
+	struct pending_spill *sp = q->spill;
+	uint32_t len;
+	char *msg;
+	int ret;
+
+	if (q->nr_msgs) {
+		if ((ret = rteipc_msg_drain(q->buf, size_out, msg_out)) > 0)
+			q->nr_msgs--;
+		return ret;
+	}
+
+	if (spill_empty(q)) {
+		q->dropped = 0;
+		return 0;
+	}
+
+	len = spill_peek(sp);
+	if (!(msg = malloc(len ? len : 1)))
+		return -1;
+	spill_read(sp, sp->head + sizeof(len), msg, len);
+	spill_drop(sp);
+	*msg_out = msg;
+	*size_out = len;
+	return 1;
+}
@@ -0,0 +1,54 @@
+// Copyright (c) 2021 Ryosuke Saito All rights reserved.
+// MIT licensed
+
+/*
+ * A pending queue holds messages from an interface that has no route yet.
+ * Messages are kept in memory up to the byte and message caps. Beyond that,
+ * they go to an optional spill ring, a file mmap'd from the spill directory
+ * and unlinked right after it is created. When both are full, the oldest
+ * message is dropped, or the new one if drop_new is set.
+ *
+ *      pending_push()                                 pending_pop()
+ *   ---> [ spill ring (newer) ] --> [ memory (older) ] --->
+ *
+ * Once a message is in the spill ring, newer messages follow it there until
+ * the ring is empty again, so that the order is kept.
+ */
+#ifndef _RTEMGR_PENDING_H
+#define _RTEMGR_PENDING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <event2/buffer.h>
+
+#define PENDING_MAX_BYTES_DEFAULT	(1 << 20)
+#define PENDING_SPILL_SIZE_DEFAULT	(16 << 20)
+
+struct pending_conf {
+	size_t max_bytes;       /* cap on bytes in memory, 0 for no limit */
+	size_t max_msgs;        /* cap on messages in memory, 0 for no limit */
+	bool drop_new;          /* drop the new message instead of the oldest */
+	const char *spill_dir;  /* directory for the spill ring, NULL for none */
+	size_t spill_size;      /* size of the spill ring */
+};
+
+struct pending_spill;
+
+struct pending {
+	const struct pending_conf *conf;
+	struct evbuffer *buf;   /* messages in memory */
+	size_t nr_msgs;         /* number of messages in buf */
+	struct pending_spill *spill;
+	bool spill_failed;      /* don't retry creating the spill ring */
+	size_t dropped;         /* messages dropped since the queue was empty */
+};
+
+int pending_init(struct pending *q, const struct pending_conf *conf);
+
+void pending_release(struct pending *q);
+
+int pending_push(struct pending *q, const void *data, size_t len);
+
+int pending_pop(struct pending *q, size_t *size_out, char **msg_out);
+
+#endif /* _RTEMGR_PENDING_H */
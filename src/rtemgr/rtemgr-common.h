@@ -5,6 +5,9 @@
 #define _RTEMGR_COMMON_H
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <event2/buffer.h>
 #include "rteipc.h"
 #include "ep.h"
 
@@ -21,11 +24,16 @@
 #define PREFIX_I2C		"i2c://"
 #define PREFIX_GPIO		"gpio://"
 #define PREFIX_SYSFS		"sysfs://"
+#define PREFIX_IIO		"iio://"
 
 #define __URI(prefix, path)	prefix path
 #define URI(bus, path)		__URI(PREFIX_##bus, path)
 
 #define RTEMGRD_CTLPORT		"@rtemgrd"
+#define RTEMGRD_FOLLOWPORT	"@rtemgrd-follow"
+
+/* Max size of the interfaces section of a packet with one interface */
+#define RTEMGR_INTF_SECTION_MAX	1024
 
 enum {
 	RTECMD_LIST = 1,
@@ -35,6 +43,9 @@ enum {
 	RTECMD_FORGET,
 	RTECMD_XFER,
 	RTECMD_CAT,
+	RTECMD_HELLO,
+	RTECMD_FOLLOW,
+	RTECMD_LOAD,
 	RTECMD_MAX
 };
 
@@ -67,6 +78,32 @@ typedef struct rtemgr_managed_data {
 	rtemgr_intf *interfaces;
 } rtemgr_data;
 
+/*
+ * Binary format of packets on a managed interface, used instead of YAML once
+ * the process connected to it has sent RTECMD_HELLO in this format (see
+ * rtemgr_use_binary()). A packet is laid out as:
+ *
+ *   | struct rtemgr_bin_hdr | name (name_len bytes) | data (len bytes) |
+ *
+ * Multi-byte fields of the header are in network byte order, and the name is
+ * not null-terminated. Unlike YAML, data is not encoded: a byte array for SPI
+ * and I2C, and a byte of 0 or 1 for GPIO, same as the raw interface.
+ */
+#define RTEMGR_BIN_MAGIC	"\0RB1"
+
+struct rtemgr_bin_hdr {
+	uint8_t magic[4];
+	uint8_t action;
+	int8_t error;
+	int8_t bus_type;
+	uint8_t name_len;
+	uint16_t domain;
+	uint16_t addr;
+	uint16_t rsize;
+	uint16_t reserved;
+	uint32_t len;
+};
+
 /* Allocate new interface and return a pointer to it */
 rtemgr_intf *rtemgr_data_alloc_interface(rtemgr_data *d);
 
@@ -82,11 +119,42 @@ rtemgr_data *rtemgr_data_alloc(void);
 /* Free rtemgr_data */
 void rtemgr_data_free(rtemgr_data *d);
 
-/* Convert rtemgr_data to yaml formatted string */
-int rtemgr_data_emit(const rtemgr_data *d, unsigned char *output, size_t size,
-			size_t *written);
+/* Convert rtemgr_data to yaml formatted string and append it to evbuffer */
+int rtemgr_data_emit(const rtemgr_data *d, struct evbuffer *out);
+
+/* Append only the interfaces section of rtemgr_data in yaml to evbuffer */
+int rtemgr_data_emit_intf(const rtemgr_data *d, struct evbuffer *out);
+
+/* Return the offset of the interfaces section at the end of a yaml packet */
+ssize_t rtemgr_data_intf_offset(const void *input, size_t size);
 
 /* Parse yaml formatted data and convert it to rtemgr_data */
 rtemgr_data *rtemgr_data_parse(const unsigned char *input, size_t size);
 
+/* Return true if data is a packet in binary format */
+bool rtemgr_bin_match(const void *input, size_t size);
+
+/* Append rtemgr_data with the first interface in binary format to evbuffer */
+int rtemgr_bin_emit(const rtemgr_data *d, struct evbuffer *out);
+
+/*
+ * Parse a packet in binary format into rtemgr_data and rtemgr_intf supplied
+ * by caller without copying, cmd.val.v points to data in @input.
+ */
+int rtemgr_bin_parse(const void *input, size_t size, rtemgr_data *d,
+			rtemgr_intf *intf);
+
+/* Append data from an interface of bus_type to evbuffer in readable form */
+int rtemgr_data_format(int bus_type, const void *msg, size_t len,
+			struct evbuffer *out);
+
+/* Length of n bytes in hex strings, i.e. "0x01 0x02 ... 0xff" */
+#define RTEMGR_HEX_LEN(n)	((n) ? (n) * 5 - 1 : 0)
+
+/* Write bytes in hex strings without a terminator, return the length */
+size_t rtemgr_hex_encode(char *dst, const void *src, size_t len);
+
+/* Parse hex strings into at most (len + 1) / 2 bytes, return the count */
+size_t rtemgr_hex_decode(uint8_t *dst, const char *src, size_t len);
+
 #endif /* _RTEMGR_COMMON_H */
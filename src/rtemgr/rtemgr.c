@@ -6,6 +6,8 @@
 #include <string.h>
 #include <getopt.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "rtemgr-common.h"
 #include "list.h"
 
@@ -39,6 +41,7 @@ static int route_parser(rtemgr_data *d, list_t *args, list_t *olist);
 static int forget_parser(rtemgr_data *d, list_t *args, list_t *olist);
 static int xfer_parser(rtemgr_data *d, list_t *args, list_t *olist);
 static int cat_parser(rtemgr_data *d, list_t *args, list_t *olist);
+static int load_parser(rtemgr_data *d, list_t *args, list_t *olist);
 
 struct argument {
 	node_t node;
@@ -90,6 +93,8 @@ static struct rtemgr_action {
 	{"forget",  RTECMD_FORGET,  "",           none_options   ,  forget_parser},
 	{"xfer",    RTECMD_XFER,    "a:o:rk:w:",  xfer_options   ,  xfer_parser  },
 	{"cat",     RTECMD_CAT,     "",           none_options   ,  cat_parser   },
+	{"follow",  RTECMD_FOLLOW,  "",           none_options   ,  cat_parser   },
+	{"load",    RTECMD_LOAD,    "",           none_options   ,  load_parser  },
 	/* The last element of the array */
 	{0,         RTECMD_MAX,     0,            0              ,  0            }
 };
@@ -105,6 +110,7 @@ static struct {
 	{EP_SPI,      "spi"},
 	{EP_I2C,      "i2c"},
 	{EP_SYSFS,    "sysfs"},
+	{EP_IIO,      "iio"},
 };
 
 static void usage(const char *prog)
@@ -120,6 +126,8 @@ static void usage(const char *prog)
 		" forget    delete an existing route between two endpoints\n"
 		" xfer      write data into an endpoint\n"
 		" cat       read data from an endpoint\n"
+		" follow    stream data from an endpoint\n"
+		" load      create endpoints and routes in a topology file\n"
 		"\n"
 		"list\n"
 		"    Print endpoints available on the system.\n"
@@ -129,7 +137,7 @@ static void usage(const char *prog)
 		"    Open a a new endpoint.\n"
 		"\n"
 		"    BUS_TYPE\n"
-		"     { ipc | inet | tty | gpio | spi | i2c | sysfs }\n"
+		"     { ipc | inet | tty | gpio | spi | i2c | sysfs | iio }\n"
 		"\n"
 		"    OPEN_OPTIONS\n"
 		"     ipc (UNIX domain socket)\n"
@@ -142,16 +150,47 @@ static void usage(const char *prog)
 		"\n"
 		"     tty\n"
 		"      speed=value     TTY baud rate (default 115200)\n"
+		"      coalesce=usec   Hold received data up to usec\n"
+		"      chunk=bytes     Send held data once it reaches bytes\n"
+		"      frame={line|slip|cobs|len8|len16|fixed|idle}\n"
+		"                      Send data per protocol frame\n"
+		"      size=bytes      Frame size for frame=fixed\n"
+		"      gap=usec        Inter-frame gap for frame=idle\n"
+		"      txmax=bytes     Limit of data waiting to be written\n"
+		"      bits={5|6|7|8}  Character size (default 8)\n"
+		"      parity={none|odd|even|mark|space}\n"
+		"                      Parity (default none)\n"
+		"      stop={1|2}      Stop bits (default 1)\n"
+		"      flow={none|rtscts|xonxoff}\n"
+		"                      Flow control (default none)\n"
+		"      low_latency     Set ASYNC_LOW_LATENCY to the driver\n"
+		"      rs485           Enable RS-485 direction control by RTS\n"
+		"      rts={high|low}  RTS level while sending (default high)\n"
+		"      rts_before=msec Delay before sending with rs485\n"
+		"      rts_after=msec  Delay after sending with rs485\n"
+		"      xact=usec       Collect the response to each message\n"
 		"\n"
 		"     gpio\n"
 		"      line=value      GPIO line offset (default 0)\n"
 		"      out or in       Set GPIO direction (default in)\n"
 		"      hi or lo        Set The initial value (default lo)\n"
+		"      debounce=usec   Report a value after it is stable for usec\n"
+		"      coalesce=usec   Report the latest value once per usec\n"
+		"      clock={monotonic|realtime|hte}\n"
+		"                      Clock of event timestamps (default monotonic)\n"
+		"      ts=ns           Report timestamps in nsec with sent time\n"
 		"\n"
 		"     spi\n"
 		"      mode={0|1|2|3}  SPI mode (default 3)\n"
 		"      speed=value     SPI speed (default 5000)\n"
 		"\n"
+		"     iio\n"
+		"      channels=name[+name...]\n"
+		"                      Scan elements enabled (default all)\n"
+		"      trigger=name    Trigger of the device\n"
+		"      length=scans    Length of the kernel buffer\n"
+		"      block=scans     Scans per message (default 16)\n"
+		"\n"
 		"close endpoint...\n"
 		"    Close endpoint specified by the name.\n"
 		"\n"
@@ -174,6 +213,22 @@ static void usage(const char *prog)
 		"cat endpoint\n"
 		"    Read data from the endpoint not routed to other.\n"
 		"    Cannot read from endpoints that is routed to any endpoint.\n"
+		"\n"
+		"follow endpoint\n"
+		"    Print data from the endpoint as it arrives until interrupted.\n"
+		"    Unlike cat, the endpoint may be routed to other, and data is\n"
+		"    still queued for cat while the endpoint is not routed.\n"
+		"\n"
+		"load FILE\n"
+		"    Create endpoints and routes described in FILE at once. Each\n"
+		"    line of FILE is an endpoint in the same columns as list:\n"
+		"\n"
+		"      NAME  BUS_TYPE  PATH  [ROUTE]\n"
+		"\n"
+		"    ROUTE is the name of an endpoint to route to, '**' for\n"
+		"    a managed endpoint, or '--' for none. PATH is the path\n"
+		"    with OPEN_OPTIONS encoded as shown by list. Lines starting\n"
+		"    with '#' are ignored.\n"
 		"\n",
 		prog);
 }
@@ -292,6 +347,7 @@ static int open_parser(rtemgr_data *d, list_t *args, list_t *olist)
 	char outval[2] = "0";
 	int speed = 0;
 	int mode = 3;
+	char extra_opts[96] = {0};
 
 	if (!strlen(intf->name)) {
 		fprintf(stderr, "'--name' must be specified.\n");
@@ -353,6 +409,61 @@ static int open_parser(rtemgr_data *d, list_t *args, list_t *olist)
 			check_bus_return_error(intf, arg->key, _m(EP_GPIO));
 			sprintf(outval, "%d",
 				strmatch(arg->key, "hi") ? 1 : 0);
+		/* 'coalesce' */
+		} else if (strmatch(arg->key, "coalesce")) {
+			check_bus_return_error(intf, arg->key,
+					_m(EP_GPIO)|_m(EP_TTY));
+			check_val_return_error(arg->key, arg->val, true);
+			snprintf(extra_opts + strlen(extra_opts),
+				sizeof(extra_opts) - strlen(extra_opts),
+				",%s=%s", arg->key, arg->val);
+		/* 'chunk', 'frame', 'size', 'gap', 'txmax', 'bits', 'parity',
+		 * 'stop', 'flow', 'rts', 'rts_before', 'rts_after' or 'xact' */
+		} else if (strmatch(arg->key, "chunk") ||
+				strmatch(arg->key, "frame") ||
+				strmatch(arg->key, "size") ||
+				strmatch(arg->key, "gap") ||
+				strmatch(arg->key, "txmax") ||
+				strmatch(arg->key, "bits") ||
+				strmatch(arg->key, "parity") ||
+				strmatch(arg->key, "stop") ||
+				strmatch(arg->key, "flow") ||
+				strmatch(arg->key, "rts") ||
+				strmatch(arg->key, "rts_before") ||
+				strmatch(arg->key, "rts_after") ||
+				strmatch(arg->key, "xact")) {
+			check_bus_return_error(intf, arg->key, _m(EP_TTY));
+			check_val_return_error(arg->key, arg->val, true);
+			snprintf(extra_opts + strlen(extra_opts),
+				sizeof(extra_opts) - strlen(extra_opts),
+				",%s=%s", arg->key, arg->val);
+		/* 'channels', 'trigger', 'length' or 'block' */
+		} else if (strmatch(arg->key, "channels") ||
+				strmatch(arg->key, "trigger") ||
+				strmatch(arg->key, "length") ||
+				strmatch(arg->key, "block")) {
+			check_bus_return_error(intf, arg->key, _m(EP_IIO));
+			check_val_return_error(arg->key, arg->val, true);
+			snprintf(extra_opts + strlen(extra_opts),
+				sizeof(extra_opts) - strlen(extra_opts),
+				",%s=%s", arg->key, arg->val);
+		/* 'low_latency' or 'rs485' */
+		} else if (strmatch(arg->key, "low_latency") ||
+				strmatch(arg->key, "rs485")) {
+			check_bus_return_error(intf, arg->key, _m(EP_TTY));
+			check_val_return_error(arg->key, arg->val, false);
+			snprintf(extra_opts + strlen(extra_opts),
+				sizeof(extra_opts) - strlen(extra_opts),
+				",%s", arg->key);
+		/* 'debounce', 'clock' or 'ts' */
+		} else if (strmatch(arg->key, "debounce") ||
+				strmatch(arg->key, "clock") ||
+				strmatch(arg->key, "ts")) {
+			check_bus_return_error(intf, arg->key, _m(EP_GPIO));
+			check_val_return_error(arg->key, arg->val, true);
+			snprintf(extra_opts + strlen(extra_opts),
+				sizeof(extra_opts) - strlen(extra_opts),
+				",%s=%s", arg->key, arg->val);
 		/* 'mode' */
 		} else if (strmatch(arg->key, "mode")) {
 			check_bus_return_error(intf, arg->key, _m(EP_SPI));
@@ -385,14 +496,17 @@ static int open_parser(rtemgr_data *d, list_t *args, list_t *olist)
 		if (!strlen(port))
 			strcat(intf->path, ":9110");
 	} else if (intf->bus_type == EP_TTY) {
-		snprintf(buf, sizeof(buf), "%s,%d", intf->path,
-				speed ?: 115200);
+		snprintf(buf, sizeof(buf), "%s,%d%s", intf->path,
+				speed ?: 115200, extra_opts);
 		snprintf(intf->path, sizeof(intf->path), "%s", buf);
 	} else if (intf->bus_type == EP_GPIO) {
 		snprintf(buf, sizeof(buf), "%s@%s-%d,%s%s%s", intf->name,
 				intf->path, line, dir,
 				strmatch(dir, "out") ? "," : "",
-				strmatch(dir, "out") ? outval : "");
+				strmatch(dir, "out") ? outval : extra_opts);
+		snprintf(intf->path, sizeof(intf->path), "%s", buf);
+	} else if (intf->bus_type == EP_IIO) {
+		snprintf(buf, sizeof(buf), "%s%s", intf->path, extra_opts);
 		snprintf(intf->path, sizeof(intf->path), "%s", buf);
 	} else if (intf->bus_type == EP_SPI) {
 		snprintf(buf, sizeof(buf), "%s,%d,%d", intf->path,
@@ -553,6 +667,55 @@ static int cat_parser(rtemgr_data *d, list_t *args, list_t *olist)
 	return 0;
 }
 
+static int load_parser(rtemgr_data *d, list_t *args, list_t *olist)
+{
+	struct argument *arg;
+	struct evbuffer *buf;
+	node_t *n;
+	int num = 0;
+	int fd;
+
+	list_each(args, n, {
+		arg = list_entry(n, struct argument, node);
+		/* load subcommand takes only one argument 'file' */
+		if (num >= 1) {
+			fprintf(stderr, "Unknown argument '%s'.\n", arg->val);
+			return -1;
+		}
+		num++;
+	})
+
+	if (num != 1)
+		return -1;
+
+	arg = list_entry(args->head, struct argument, node);
+	if ((fd = open(arg->val, O_RDONLY)) < 0) {
+		fprintf(stderr, "Cannot open '%s'.\n", arg->val);
+		return -1;
+	}
+
+	if (!(buf = evbuffer_new())) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	/* Send the topology as it is, rtemgrd parses it */
+	while (evbuffer_read(buf, fd, -1) > 0)
+		;
+	close(fd);
+
+	d->cmd.val.s = evbuffer_get_length(buf);
+	if (d->cmd.val.s && (d->cmd.val.v = malloc(d->cmd.val.s)))
+		evbuffer_remove(buf, d->cmd.val.v, d->cmd.val.s);
+	evbuffer_free(buf);
+
+	if (!d->cmd.val.v) {
+		fprintf(stderr, "Cannot read '%s'.\n", arg->val);
+		return -1;
+	}
+	return 0;
+}
+
 static inline struct rtemgr_action *get_rtemgr_action(const char *cmd)
 {
 	int i = 0;
@@ -722,6 +885,10 @@ static void reply_callback(int ctx, void *data, size_t len, void *arg)
 			"Failed to transfer data to",
 			intf->name);
 		break;
+	case RTECMD_LOAD:
+		printf("%s.\n", !d->cmd.error ?
+			"Successfully loaded" : "Failed to load some of endpoints");
+		break;
 	case RTECMD_CAT:
 		if (!d->cmd.error) {
 			printf("%.*s\n", d->cmd.val.s, d->cmd.val.v);
@@ -736,6 +903,54 @@ out:
 	event_base_loopbreak(base);
 }
 
+/*
+ * The first message from rtemgrd is the reply in YAML, then data from the
+ * endpoint follows in binary format.
+ */
+static void follow_callback(int ctx, void *data, size_t len, void *arg)
+{
+	static bool following;
+	struct event *ev = arg;
+	struct evbuffer *out;
+	rtemgr_data *d, bin;
+	rtemgr_intf intf;
+
+	if (!following) {
+		if (!(d = rtemgr_data_parse(data, len)))
+			return;
+		if (d->cmd.error || !d->interfaces) {
+			printf("Failed to follow '%s'.\n", d->interfaces ?
+					d->interfaces->name : "");
+			event_base_loopbreak(event_get_base(ev));
+		} else {
+			/* Wait for data without timeout from now on */
+			evtimer_del(ev);
+			following = true;
+		}
+		rtemgr_data_free(d);
+		return;
+	}
+
+	if (rtemgr_bin_parse(data, len, &bin, &intf) ||
+			bin.cmd.action != RTECMD_XFER)
+		return;
+
+	if (!(out = evbuffer_new()))
+		return;
+	if (!rtemgr_data_format(intf.bus_type, bin.cmd.val.v,
+				bin.cmd.val.s, out)) {
+		fwrite(evbuffer_pullup(out, -1), 1,
+				evbuffer_get_length(out), stdout);
+		fflush(stdout);
+	}
+	evbuffer_free(out);
+}
+
+static void follow_err_callback(int ctx, short events, void *arg)
+{
+	printf("Endpoint closed.\n");
+}
+
 static void timeout_handler(int sock, short which, void *arg)
 {
 	struct event_base *base = arg;
@@ -762,8 +977,7 @@ int main(int argc, char *argv[])
 		xfer_options,    /* 'xfer' */
 	};
 
-	unsigned char buf[4096] = {0};
-	size_t written;
+	struct evbuffer *buf;
 
 	struct event_base *base;
 	struct event *ev;
@@ -828,21 +1042,29 @@ int main(int argc, char *argv[])
 	d = subcmd_opt_check(argc, argv, entry);
 
 	/* connect to rtemgrd service */
-	ctx = rteipc_connect(URI(IPC, RTEMGRD_CTLPORT));
+	if (d->cmd.action == RTECMD_FOLLOW)
+		ctx = rteipc_connect(URI(IPC, RTEMGRD_FOLLOWPORT));
+	else
+		ctx = rteipc_connect(URI(IPC, RTEMGRD_CTLPORT));
 	if (ctx < 0) {
 		fprintf(stderr, "Failed to connect to rtemgrd.\n");
 		exit(EXIT_FAILURE);
 	}
 
 	/* convert data to formatted string */
-	if (rtemgr_data_emit(d, buf, sizeof(buf), &written)) {
+	buf = evbuffer_new();
+	if (!buf || rtemgr_data_emit(d, buf)) {
 		fprintf(stderr, "Failed to emit data\n");
 		return -1;
 	}
 
 	/* send request to rtemgrd service */
-	rteipc_send(ctx, buf, written);
-	rteipc_setcb(ctx, reply_callback, NULL, base, 0);
+	rteipc_evsend(ctx, buf);
+	evbuffer_free(buf);
+	if (d->cmd.action == RTECMD_FOLLOW)
+		rteipc_setcb(ctx, follow_callback, follow_err_callback, ev, 0);
+	else
+		rteipc_setcb(ctx, reply_callback, NULL, base, 0);
 	rteipc_dispatch(NULL);
 	rteipc_shutdown();
 	return 0;
@@ -14,6 +14,7 @@
 #define BUS_I2C			5
 #define BUS_SYSFS		6
 #define BUS_INET		7
+#define BUS_IIO			9
 
 #define DOMAIN_RTEMGR		0
 
@@ -53,6 +54,16 @@
 	rtemgr_sysfs_encode_domain(DOMAIN_RTEMGR, name, attr, newval, \
 			p_out, p_size)
 
+/**
+ * Switch the connection to a managed interface to binary format, in which
+ * data is passed as it is instead of being encoded in YAML. Subsequent
+ * rtemgr_*_send_domain() on @ctx send packets in binary format, and rtemgrd
+ * sends packets to the process in binary format too. rtemgr_decode() accepts
+ * both formats. The format lasts until the connection closes, and is reset
+ * to YAML by rteipc_setcb(), so call this after setting the callbacks.
+ */
+int rtemgr_use_binary(int ctx);
+
 /**
  * Helper function to send generic data to the rtemgr managed interface.
  * For raw (non-managed) interface, use rteipc_send().
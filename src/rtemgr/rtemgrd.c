@@ -5,9 +5,17 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+#include <event2/thread.h>
 #include "rtemgr-common.h"
 #include "message.h"
 #include "list.h"
+#include "pending.h"
 
 
 /**
@@ -18,6 +26,7 @@ struct domain {
 	char name[64];
 	list_t iface_list;
 	node_t node;
+	struct domain *hnext;  /* next in the same bucket of domain_hash */
 };
 
 /**
@@ -34,15 +43,109 @@ struct interface {
 	int bus_type;
 	struct domain *domain;
 	int managed;
+	int binary;  /* packets in binary format for a managed iface */
+	bool opening;  /* endpoint being opened by the control worker */
+	bool closing;  /* closed while opening, freed once opened */
 	iface_handler handler;
 	struct interface *partner;  /* always NULL for a managed iface */
-	struct evbuffer *pending;
+	struct pending pending;  /* data while a raw iface has no route */
+	list_t followers;  /* processes streaming data from a raw iface */
 	node_t node;
+	struct interface *hnext;  /* next in the same bucket of iface_hash */
+};
+
+/**
+ * Follower is a process connected to RTEMGRD_FOLLOWPORT to stream data from
+ * a raw interface. It sends a request with RTECMD_FOLLOW once, then receives
+ * every message from the backend device of the interface in binary format.
+ */
+struct follower {
+	struct bufferevent *bev;
+	struct interface *iface;  /* NULL until the request succeeds */
+	size_t dropped;           /* messages dropped since it fell behind */
+	node_t node;
+};
+
+/* Data a follower has not read yet, newer data is dropped beyond it */
+#define FOLLOW_BACKLOG_MAX	(1 << 20)
+
+/* Route in a topology, made after all the interfaces are opened */
+struct topo_route {
+	char lh[16];
+	char rh[16];
+	int line;
+};
+
+/**
+ * Control session is a connection of a client to RTEMGRD_CTLPORT, which can
+ * be any number at a time. A reply goes to the session sent the request.
+ * Data addressed to the control interface goes to sessions that have sent
+ * data through it, as a managed interface would do for its process.
+ */
+struct ctl_session {
+	struct bufferevent *bev;  /* NULL once disconnected */
+	int refs;                 /* the connection, and requests in progress */
+	int binary;               /* data in binary format */
+	bool data;                /* receives data to the control interface */
+	node_t node;
+};
+
+/**
+ * Control request that opens interfaces, replied once all the endpoints
+ * opened by the control worker are ready.
+ */
+struct ctl_batch {
+	struct ctl_session *session;
+	rtemgr_data *req;
+	int refs;      /* jobs in the worker, and one while being issued */
+	int err;
+	struct topo_route *routes;
+	int nr_routes;
+};
+
+/**
+ * Opening or closing an endpoint of a device may block, e.g. udev
+ * enumeration or waiting for a tty to drain, which would stall routing data
+ * of all the other interfaces. Such endpoints are opened and closed by the
+ * control worker thread, and the result of opening is posted back to the
+ * event loop, which binds it to the loopback.
+ */
+enum {
+	CTL_JOB_OPEN,
+	CTL_JOB_CLOSE,
+};
+
+struct ctl_job {
+	int op;
+	int ep;                   /* endpoint opened, or to be closed */
+	char uri[128];
+	struct interface *iface;  /* iface whose endpoint is opened */
+	struct ctl_batch *batch;
+	struct ctl_job *next;
+};
+
+struct ctl_job_queue {
+	struct ctl_job *head;
+	struct ctl_job *tail;
+};
+
+static struct {
+	bool running;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct ctl_job_queue todo;
+	struct ctl_job_queue done;
+	struct event *done_ev;  /* activated when a job is done */
+} ctl_worker = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
 };
 
 static void default_domain_handler(const char *name, void *data, size_t len, void *arg);
 static void iface_raw_handler(struct interface *self, void *data, size_t len);
 static void iface_managed_handler(struct interface *self, void *data, size_t len);
+static void ctl_send_data(const rtemgr_data *d);
 
 /* Default domain */
 struct domain default_domain = {
@@ -54,9 +157,35 @@ struct domain default_domain = {
 /* List of all domains */
 static list_t domain_list = LIST_INITIALIZER;
 
+/*
+ * Hash tables to look up domains by id and interfaces by (domain, name) in
+ * constant time, which is done for every managed packet. The lists above are
+ * kept for iteration.
+ */
+#define DOMAIN_HASH_SIZE	16
+#define IFACE_HASH_SIZE		256
+
+static struct domain *domain_hash[DOMAIN_HASH_SIZE];
+static struct interface *iface_hash[IFACE_HASH_SIZE];
+
 /* @rtemgr control interface */
 static struct interface *ctrl_iface;
 
+/* Sessions connected to the control interface */
+static list_t ctl_sessions = LIST_INITIALIZER;
+
+/* Topology read from the file given by -f option */
+static char *topology;
+
+/* Buffer to build packets to be sent */
+static struct evbuffer *out_buf;
+
+/* Limits of pending queues, set by -p option */
+static struct pending_conf pending_conf = {
+	.max_bytes = PENDING_MAX_BYTES_DEFAULT,
+	.spill_size = PENDING_SPILL_SIZE_DEFAULT,
+};
+
 static struct bus_prefix {
 	int bus;
 	char *prefix;
@@ -68,8 +197,25 @@ static struct bus_prefix {
 	{ EP_SPI,   PREFIX_SPI },
 	{ EP_I2C,   PREFIX_I2C },
 	{ EP_SYSFS, PREFIX_SYSFS },
+	{ EP_IIO,   PREFIX_IIO },
 };
 
+/**
+ * Bus name as in URI prefix (e.g. "tty" for "tty://") to bus_type.
+ */
+static int str_to_bus(const char *str)
+{
+	size_t len = strlen(str);
+	int i;
+
+	for (i = 0; i < array_size(bus_prefix_tbl); i++) {
+		if (!strncmp(bus_prefix_tbl[i].prefix, str, len) &&
+				!strcmp(bus_prefix_tbl[i].prefix + len, "://"))
+			return bus_prefix_tbl[i].bus;
+	}
+	return -1;
+}
+
 /**
  * bus_type to URI prefix.
  * The length of @buf is expected to be greater than 128.
@@ -84,70 +230,98 @@ static inline const char *bus_to_prefix(int bus)
 	return "";
 }
 
-static inline size_t hex_to_array(uint8_t **out, const char *str)
+static inline unsigned int domain_hash_key(int domain_id)
 {
-	char *hex, *s;
-	uint8_t *arr;
-	size_t count;
-	int i;
-
-	if (!strlen(str))
-		return 0;
+	return (unsigned int)domain_id % DOMAIN_HASH_SIZE;
+}
 
-	s = strdup(str);
-	if (!s)
-		return 0;
+/* FNV-1a hash of name, seeded with domain id */
+static inline unsigned int iface_hash_key(int domain_id, const char *name)
+{
+	uint32_t h = 2166136261u ^ (uint32_t)domain_id;
 
-	count = 1;
-	/* Count up for each occurence of a space in the string */
-	for (i = 0; i < strlen(str); i++) {
-		if (str[i] == ' ')
-			count++;
+	while (*name) {
+		h ^= (uint8_t)*name++;
+		h *= 16777619u;
 	}
+	return h % IFACE_HASH_SIZE;
+}
 
-	arr = calloc(count, sizeof(uint8_t));
-	if (!arr) {
-		free(s);
-		return 0;
-	}
+static void domain_hash_add(struct domain *domain)
+{
+	struct domain **head = &domain_hash[domain_hash_key(domain->id)];
 
-	i = 0;
-	hex = strtok(s, " ");
-	do {
-		arr[i++] = strtoul(hex, NULL, 16);
-	} while (hex = strtok(NULL, " "));
+	domain->hnext = *head;
+	*head = domain;
+}
 
-	*out = arr;
-	return count;
+static void iface_hash_add(struct interface *iface)
+{
+	struct interface **head;
+
+	head = &iface_hash[iface_hash_key(iface->domain->id, iface->name)];
+	iface->hnext = *head;
+	*head = iface;
+}
+
+static void iface_hash_del(struct interface *iface)
+{
+	struct interface **pp;
+
+	pp = &iface_hash[iface_hash_key(iface->domain->id, iface->name)];
+	for (; *pp; pp = &(*pp)->hnext) {
+		if (*pp == iface) {
+			*pp = iface->hnext;
+			return;
+		}
+	}
 }
 
 static struct interface *iface_lookup_by_name(struct domain *domain,
 			const char *name)
 {
 	struct interface *iface;
+
+	if (!domain)
+		return NULL;
+
+	iface = iface_hash[iface_hash_key(domain->id, name)];
+	for (; iface; iface = iface->hnext) {
+		if (iface->domain == domain && !strcmp(iface->name, name))
+			return iface;
+	}
+	return NULL;
+}
+
+/**
+ * Look up an iface whose endpoint is still being opened by the control
+ * worker. It is not in iface_hash until then, and is rare enough to walk.
+ */
+static struct interface *iface_lookup_opening(struct domain *domain,
+			const char *name)
+{
+	struct interface *iface;
 	node_t *n;
 
 	if (!domain)
 		return NULL;
 
-	list_each(&domain->iface_list, n, {
+	for (n = domain->iface_list.head; n; n = n->next) {
 		iface = list_entry(n, struct interface, node);
-		if (strmatch(iface->name, name))
+		if (iface->opening && !strcmp(iface->name, name))
 			return iface;
-	})
+	}
 	return NULL;
 }
 
 static struct domain *domain_lookup_by_id(int domain_id)
 {
-	struct domain *domain;
-	node_t *n;
+	struct domain *domain = domain_hash[domain_hash_key(domain_id)];
 
-	list_each(&domain_list, n, {
-		domain = list_entry(n, struct domain, node);
+	for (; domain; domain = domain->hnext) {
 		if (domain->id == domain_id)
 			return domain;
-	})
+	}
 	return NULL;
 }
 
@@ -157,8 +331,7 @@ static struct interface *iface_new(struct domain *domain)
 
 	if ((iface = calloc(1, sizeof(*iface)))) {
 		iface->domain = domain;
-		iface->pending = evbuffer_new();
-		if (!iface->pending) {
+		if (pending_init(&iface->pending, &pending_conf)) {
 			free(iface);
 			return NULL;
 		}
@@ -206,30 +379,105 @@ static void iface_forget(struct interface *iface)
 	})
 }
 
+static void ctl_job_push(struct ctl_job_queue *q, struct ctl_job *job)
+{
+	job->next = NULL;
+	if (q->tail)
+		q->tail->next = job;
+	else
+		q->head = job;
+	q->tail = job;
+}
+
+static struct ctl_job *ctl_job_pop(struct ctl_job_queue *q)
+{
+	struct ctl_job *job = q->head;
+
+	if (job && !(q->head = job->next))
+		q->tail = NULL;
+	return job;
+}
+
+static void ctl_job_submit(struct ctl_job *job)
+{
+	pthread_mutex_lock(&ctl_worker.lock);
+	ctl_job_push(&ctl_worker.todo, job);
+	pthread_cond_signal(&ctl_worker.cond);
+	pthread_mutex_unlock(&ctl_worker.lock);
+}
+
+/**
+ * Return true if opening or closing an endpoint of the bus may block.
+ */
+static inline bool bus_may_block(int bus_type)
+{
+	return ctl_worker.running && bus_type != EP_IPC &&
+		bus_type != EP_INET && bus_type != EP_SHM;
+}
+
+/**
+ * Close the endpoint of iface, which must have been unbound from the
+ * loopback, on the worker if it may block.
+ */
+static void iface_close_ep(struct interface *iface)
+{
+	struct ctl_job *job;
+
+	if (bus_may_block(iface->bus_type) &&
+			(job = calloc(1, sizeof(*job)))) {
+		job->op = CTL_JOB_CLOSE;
+		job->ep = iface->ep;
+		ctl_job_submit(job);
+	} else {
+		rteipc_close(iface->ep);
+	}
+	iface->ep = -1;
+}
+
+static void follow_free(struct follower *f)
+{
+	if (f->iface)
+		list_remove(&f->iface->followers, &f->node);
+	bufferevent_free(f->bev);
+	free(f);
+}
+
 static void iface_free(struct interface *iface)
 {
+	struct follower *f;
+
 	if (!iface)
 		return;
 
 	if (iface->id >= 0)
 		rteipc_close(iface->id);
 
+	/* The loopback is closed first, which unbinds the endpoint */
 	if (iface->ep >= 0)
-		rteipc_close(iface->ep);
+		iface_close_ep(iface);
 
-	if (iface->domain)
+	if (iface->domain) {
+		iface_hash_del(iface);
 		list_remove(&iface->domain->iface_list, &iface->node);
+	}
 
 	iface_forget(iface);
+	pending_release(&iface->pending);
+	/* Followers see the connection closed */
+	while (!list_empty(&iface->followers)) {
+		f = list_entry(list_pop(&iface->followers),
+				struct follower, node);
+		f->iface = NULL;
+		follow_free(f);
+	}
 	free(iface);
 }
 
 /**
- * Create a new iface that belongs to the domain.
+ * Fill in an iface and open its loopback, the endpoint is opened later.
  */
-static inline
-int iface_build(struct interface *iface, const char *name, const char *path,
-			int bus_type, int managed)
+static void iface_setup(struct interface *iface, const char *name,
+			const char *path, int bus_type, int managed)
 {
 	char uri[128];
 
@@ -239,41 +487,72 @@ int iface_build(struct interface *iface, const char *name, const char *path,
 	snprintf(uri, sizeof(uri), "%s%s", bus_to_prefix(bus_type), path);
 	strcpy(iface->uri, uri);
 	iface->id = rteipc_open(iface->name);
-	iface->ep = rteipc_open(iface->uri);
+	iface->ep = -1;
 	rteipc_xfer_setcb(iface->name, default_domain_handler, iface);
 	iface->handler = (iface->managed) ?
 		iface_managed_handler : iface_raw_handler;
+}
+
+/**
+ * Callback function called when the process behind a managed iface has
+ * disconnected. The next process speaks YAML until it sends binary format.
+ */
+static void iface_hup_handler(int ep, void *arg)
+{
+	struct interface *iface = arg;
+
+	iface->binary = 0;
+}
 
+/**
+ * Bind the loopback of iface to the endpoint opened.
+ */
+static int iface_attach(struct interface *iface)
+{
 	if (iface->id < 0 || iface->ep < 0)
 		return -1;
 
 	if (rteipc_bind(iface->id, iface->ep) < 0)
 		return -1;
 
+	if (iface->managed && (iface->bus_type == EP_IPC ||
+			iface->bus_type == EP_INET || iface->bus_type == EP_SHM))
+		rteipc_hup_setcb(iface->ep, iface_hup_handler, iface);
+
+	iface_hash_add(iface);
 	return 0;
 }
 
+/**
+ * Create a new iface that belongs to the domain.
+ */
+static inline
+int iface_build(struct interface *iface, const char *name, const char *path,
+			int bus_type, int managed)
+{
+	iface_setup(iface, name, path, bus_type, managed);
+	iface->ep = rteipc_open(iface->uri);
+	return iface_attach(iface);
+}
+
 /**
  * Preserve data in the pending queue.
  * Data in the pending queue will be sent out as soon as iface gets a partner.
  */
 static int iface_pending(struct interface *iface, void *data, size_t len)
 {
-	struct evbuffer *buf;
-	size_t sz;
-	size_t nl;
+	size_t dropped = iface->pending.dropped;
+	int ret;
 
-	if (!(buf = evbuffer_new())) {
+	ret = pending_push(&iface->pending, data, len);
+	if (ret < 0) {
 		fprintf(stderr,
 			"Discarded pending data due to memory allocation error\n");
 		return -1;
 	}
-	evbuffer_add(buf, data, len);
-	sz = evbuffer_get_length(buf);
-	nl = htonl(sz);
-	evbuffer_prepend(buf, &nl, 4);
-	evbuffer_add_buffer(iface->pending, buf);
-	evbuffer_free(buf);
+	if (ret > 0 && !dropped)
+		fprintf(stderr, "Pending queue of %s is full, dropping data\n",
+				iface->name);
 	return 0;
 }
 
@@ -290,7 +569,7 @@ static void iface_trigger(struct interface *iface)
 		return;
 
 	for (;;) {
-		if (!(err = rteipc_msg_drain(iface->pending, &len, &msg)))
+		if (!(err = pending_pop(&iface->pending, &len, &msg)))
 			return;
 
 		if (err < 0) {
@@ -302,6 +581,176 @@ static void iface_trigger(struct interface *iface)
 	}
 }
 
+/**
+ * Create a new iface that belongs to the domain and build it.
+ */
+static struct interface *iface_open(struct domain *domain, const char *name,
+			const char *path, int bus_type, int managed)
+{
+	struct interface *iface;
+
+	if (!(iface = iface_new(domain)))
+		return NULL;
+
+	if (iface_build(iface, name, path, bus_type, managed)) {
+		iface_free(iface);
+		return NULL;
+	}
+	return iface;
+}
+
+/**
+ * Route data between two ifaces.
+ */
+static int iface_route(struct interface *lh, struct interface *rh)
+{
+	if (!lh || !rh || lh == rh)
+		return -1;
+
+	/*
+	 * A raw (non-managed) iface must be bound to a specific one in order
+	 * to route a packet whereas a managed iface does not need to bind to
+	 * any other as it can have a destination in a packet.
+	 */
+	if (!lh->managed) {
+		lh->partner = rh;
+		iface_trigger(lh);
+	}
+	if (!rh->managed) {
+		rh->partner = lh;
+		iface_trigger(rh);
+	}
+	return 0;
+}
+
+/**
+ * Same as iface_open(), but the endpoint is opened by the control worker if
+ * it may block, and the iface is ready by the time batch is done.
+ */
+static int iface_open_async(struct domain *domain, const char *name,
+			const char *path, int bus_type, int managed,
+			struct ctl_batch *batch)
+{
+	struct interface *iface;
+	struct ctl_job *job;
+
+	if (!batch || !bus_may_block(bus_type))
+		return iface_open(domain, name, path, bus_type, managed) ?
+			0 : -1;
+
+	if (!(job = calloc(1, sizeof(*job))))
+		return -1;
+
+	if (!(iface = iface_new(domain))) {
+		free(job);
+		return -1;
+	}
+
+	iface_setup(iface, name, path, bus_type, managed);
+	iface->opening = true;
+	job->op = CTL_JOB_OPEN;
+	job->iface = iface;
+	job->batch = batch;
+	strcpy(job->uri, iface->uri);
+	batch->refs++;
+	ctl_job_submit(job);
+	return 0;
+}
+
+/**
+ * Fill in the sender info of a managed packet.
+ */
+static void iface_set_sender(rtemgr_intf *intf, struct interface *self)
+{
+	intf->id = self->id;
+	intf->bus_type = self->bus_type;
+	strcpy(intf->name, self->name);
+	strcpy(intf->path, self->uri);
+	intf->domain = self->domain->id;
+	intf->managed = self->managed;
+	if (self->partner)
+		strcpy(intf->partner, self->partner->name);
+}
+
+/**
+ * Send data from the backend device of iface to all its followers. A
+ * follower that falls behind by FOLLOW_BACKLOG_MAX misses data until it
+ * catches up, instead of holding memory of the daemon.
+ */
+static void follow_publish(struct interface *iface, void *data, size_t len)
+{
+	rtemgr_data d = {0};
+	rtemgr_intf intf = {0};
+	struct follower *f;
+	struct evbuffer *out;
+	unsigned char *frame;
+	uint32_t nl;
+	size_t flen;
+	node_t *n;
+
+	if (list_empty(&iface->followers))
+		return;
+
+	/* Data is not copied, d must not be passed to rtemgr_data_free */
+	d.cmd.action = RTECMD_XFER;
+	d.cmd.val.v = data;
+	d.cmd.val.s = len;
+	d.nr_intf = 1;
+	d.interfaces = &intf;
+	iface_set_sender(&intf, iface);
+	if (rtemgr_bin_emit(&d, out_buf))
+		goto out;
+
+	/* Frame the packet once and copy it to each follower */
+	nl = htonl(evbuffer_get_length(out_buf));
+	evbuffer_prepend(out_buf, &nl, sizeof(nl));
+	flen = evbuffer_get_length(out_buf);
+	if (!(frame = evbuffer_pullup(out_buf, -1)))
+		goto out;
+
+	list_each(&iface->followers, n, {
+		f = list_entry(n, struct follower, node);
+		out = bufferevent_get_output(f->bev);
+		if (evbuffer_get_length(out) >= FOLLOW_BACKLOG_MAX) {
+			if (!f->dropped++)
+				fprintf(stderr, "Follower of %s is behind, "
+						"dropping data\n", iface->name);
+			continue;
+		}
+		if (f->dropped) {
+			fprintf(stderr, "Follower of %s missed %zu messages\n",
+					iface->name, f->dropped);
+			f->dropped = 0;
+		}
+		evbuffer_add(out, frame, flen);
+	})
+out:
+	evbuffer_drain(out_buf, evbuffer_get_length(out_buf));
+}
+
+/**
+ * Send a managed packet to the process behind a managed iface in the format
+ * it speaks.
+ */
+static void iface_managed_send(struct interface *dest, const rtemgr_data *d)
+{
+	int err;
+
+	if (dest == ctrl_iface) {
+		ctl_send_data(d);
+		return;
+	}
+
+	if (dest->binary)
+		err = rtemgr_bin_emit(d, out_buf);
+	else
+		err = rtemgr_data_emit(d, out_buf);
+
+	if (!err)
+		rteipc_evxfer(dest->name, out_buf);
+	evbuffer_drain(out_buf, evbuffer_get_length(out_buf));
+}
+
 /**
  * Callback function to handle data from a backend device on a raw
  * (i.e. non-managed) interface.
@@ -309,11 +758,8 @@ static void iface_trigger(struct interface *iface)
 static void iface_raw_handler(struct interface *self, void *data, size_t len)
 {
 	struct interface *partner = self->partner;
-	rtemgr_data *d = NULL;
-	rtemgr_intf *intf = NULL;
-	void *val = NULL;
-	unsigned char *buf = NULL;
-	size_t bufsz, written;
+	rtemgr_data d = {0};
+	rtemgr_intf intf = {0};
 
 	if (!partner) {
 		/* If iface has no route yet, preserve data */
@@ -325,41 +771,69 @@ static void iface_raw_handler(struct interface *self, void *data, size_t len)
 		/* raw to raw interface */
 		rteipc_xfer(partner->name, data, len);
 	} else {
-		/* raw to managed interface */
-		bufsz = len * 3 / 2;
-		if (bufsz < 512)
-			bufsz = 512;
-		if ((val = malloc(len)) &&
-				(buf = malloc(bufsz)) &&
-				(d = rtemgr_data_alloc()) &&
-				(intf = rtemgr_data_alloc_interface(d))) {
-			d->cmd.action = RTECMD_XFER;
-			/*
-			 * Do not assign the pointer to data to cmd.val.v
-			 * directly, which causes the double free error as
-			 * rtemgr_data_free and rteipc core does it.
-			 */
-			memcpy(val, data, len);
-			d->cmd.val.v = val;
-			d->cmd.val.s = len;
-			/*
-			 * Setup sender info.
-			 */
-			intf->id = self->id;
-			intf->bus_type = self->bus_type;
-			strcpy(intf->name, self->name);
-			strcpy(intf->path, self->uri);
-			intf->domain = self->domain->id;
-			intf->managed = self->managed;
-			strcpy(intf->partner, self->partner->name);
-			if (!rtemgr_data_emit(d, buf, bufsz, &written))
-				rteipc_xfer(partner->name, buf, written);
-		}
-		free(buf);
-		rtemgr_data_free(d);  /* This also free val */
+		/*
+		 * raw to managed interface. Data is not copied, and d must
+		 * not be passed to rtemgr_data_free.
+		 */
+		d.cmd.action = RTECMD_XFER;
+		d.cmd.val.v = data;
+		d.cmd.val.s = len;
+		d.nr_intf = 1;
+		d.interfaces = &intf;
+		iface_set_sender(&intf, self);
+		iface_managed_send(partner, &d);
 	}
 }
 
+/**
+ * Forward a packet in YAML format from a managed iface to another managed
+ * iface speaking YAML without decoding data in it. Only the interfaces
+ * section at the end of the packet is parsed, and replaced with the sender.
+ *
+ * Return 0 if forwarded, -1 if the packet must be handled normally.
+ */
+static int iface_managed_forward(struct interface *self, void *data,
+			size_t len)
+{
+	rtemgr_data *d;
+	struct interface *dest;
+	ssize_t off;
+	int err = -1;
+
+	if ((off = rtemgr_data_intf_offset(data, len)) < 0)
+		return -1;
+
+	if (!(d = rtemgr_data_parse((unsigned char *)data + off, len - off)))
+		return -1;
+
+	/* The section must hold only the destination */
+	if (d->cmd.action || d->nr_intf != 1 || !d->interfaces)
+		goto out;
+
+	dest = iface_lookup_by_name(
+			domain_lookup_by_id(d->interfaces->domain),
+			d->interfaces->name);
+	if (!dest || !dest->managed || dest->binary || dest == ctrl_iface)
+		goto out;
+
+	switch (dest->bus_type) {
+	case EP_GPIO:
+	case EP_SPI:
+	case EP_I2C:
+		goto out;
+	}
+
+	iface_set_sender(d->interfaces, self);
+	if (!evbuffer_add(out_buf, data, off) &&
+			!rtemgr_data_emit_intf(d, out_buf))
+		rteipc_evxfer(dest->name, out_buf);
+	evbuffer_drain(out_buf, evbuffer_get_length(out_buf));
+	err = 0;
+out:
+	rtemgr_data_free(d);
+	return err;
+}
+
 /**
  * Callback function to handle data from a backend device (i.e. IPC socket) on
  * a managed interface.
@@ -367,18 +841,34 @@ static void iface_raw_handler(struct interface *self, void *data, size_t len)
 static void iface_managed_handler(struct interface *self, void *data,
 			size_t len)
 {
-	rtemgr_data *d;
-	rtemgr_intf *intf;
+	rtemgr_data *d, bin;
+	rtemgr_intf bin_intf;
 	struct interface *dest;
 	const char *name;
 	void *value;
-	size_t size;
-	uint8_t *byte_array, *new_array;
-	unsigned char *buf;
-	size_t bufsz, written;
+	size_t size, alloc;
+	uint8_t *byte_array = NULL;
+	const uint8_t *array;
+	uint16_t rsize;
 
-	if (!(d = rtemgr_data_parse(data, len)))
-		return;
+	/*
+	 * The process speaks binary format once it sends a packet in it,
+	 * which is parsed in place.
+	 */
+	if (rtemgr_bin_match(data, len)) {
+		if (rtemgr_bin_parse(data, len, &bin, &bin_intf))
+			return;
+		self->binary = 1;
+		if (bin.cmd.action == RTECMD_HELLO)
+			return;
+		d = &bin;
+	} else {
+		self->binary = 0;
+		if (!iface_managed_forward(self, data, len))
+			return;
+		if (!(d = rtemgr_data_parse(data, len)))
+			return;
+	}
 
 	if (d->nr_intf != 1 || !d->interfaces)
 		goto out;
@@ -392,6 +882,7 @@ static void iface_managed_handler(struct interface *self, void *data,
 	name = dest->name;
 	value = d->cmd.val.v;
 	size = d->cmd.val.s;
+	rsize = d->cmd.val.extra.rsize;
 	if (!value || !size)
 		goto out;
 
@@ -404,63 +895,60 @@ static void iface_managed_handler(struct interface *self, void *data,
 			rteipc_xfer(name, value, size);
 		} else {
 			/* managed to managed interface */
-			bufsz = len + 512;
-			if ((buf = malloc(bufsz))) {
-				/*
-				 * Setup sender info.
-				 */
-				intf = d->interfaces;
-				intf->id = self->id;
-				intf->bus_type = self->bus_type;
-				strcpy(intf->name, self->name);
-				strcpy(intf->path, self->uri);
-				intf->domain = self->domain->id;
-				intf->managed = self->managed;
-				if (self->partner)
-					strcpy(intf->partner, self->partner->name);
-				if (!rtemgr_data_emit(d, buf, bufsz, &written))
-					rteipc_xfer(name, buf, written);
-				free(buf);
-			}
+			iface_set_sender(d->interfaces, self);
+			iface_managed_send(dest, d);
 		}
 		break;
 	case EP_GPIO:
-		rteipc_gpio_xfer(name, strmatch(value, "0") ? 0 : 1);
+		if (d == &bin)
+			rteipc_gpio_xfer(name, !!*(uint8_t *)value);
+		else
+			rteipc_gpio_xfer(name, strmatch(value, "0") ? 0 : 1);
 		break;
 	case EP_SPI:
 	case EP_I2C:
-		/* Hex strings to byte array */
-		size = hex_to_array(&byte_array, value);
+		/* SPI reads as many bytes as it writes */
+		alloc = (d == &bin) ? size : (size + 1) / 2;
+		if (dest->bus_type == EP_SPI && alloc < rsize)
+			alloc = rsize;
+
+		if (d == &bin && alloc == size) {
+			/* Already a byte array */
+			array = value;
+		} else {
+			byte_array = malloc(alloc);
+			if (!byte_array) {
+				fprintf(stderr, "Failed to allocate buf.\n");
+				goto out;
+			}
+			if (d == &bin)
+				memcpy(byte_array, value, size);
+			else
+				/* Hex strings to byte array */
+				size = rtemgr_hex_decode(byte_array, value,
+							size);
+			array = byte_array;
+		}
 		if (size) {
 			if (dest->bus_type == EP_SPI) {
-				if (size < d->cmd.val.extra.rsize) {
-					new_array = realloc(byte_array,
-							d->cmd.val.extra.rsize);
-					if (!new_array) {
-						fprintf(stderr,
-							"Failed to expand buf.\n");
-						free(byte_array);
-						goto out;
-					}
-					memset(new_array + size, 0,
-						d->cmd.val.extra.rsize - size);
-					byte_array = new_array;
-					size = d->cmd.val.extra.rsize;
+				if (size < rsize) {
+					memset(byte_array + size, 0,
+						rsize - size);
+					size = rsize;
 				}
-				rteipc_spi_xfer(name, byte_array, size,
-						!!d->cmd.val.extra.rsize);
+				rteipc_spi_xfer(name, array, size, !!rsize);
 			} else {
 				rteipc_i2c_xfer(name,
 						d->cmd.val.extra.addr,
-						byte_array, size,
-						d->cmd.val.extra.rsize);
+						array, size, rsize);
 			}
-			free(byte_array);
 		}
 		break;
 	}
 out:
-	rtemgr_data_free(d);
+	free(byte_array);
+	if (d != &bin)
+		rtemgr_data_free(d);
 }
 
 static void domain_collect_ifaces(rtemgr_data *d, struct domain *domain)
@@ -501,10 +989,9 @@ static int do_rtecmd_list(rtemgr_data *d)
 	return 0;
 }
 
-static int do_rtecmd_open(rtemgr_data *d)
+static int do_rtecmd_open(rtemgr_data *d, struct ctl_batch *batch)
 {
 	rtemgr_intf *intf;
-	struct interface *iface;
 	struct domain *domain;
 
 	if (!(intf = d->interfaces) || d->nr_intf < 1)
@@ -518,18 +1005,8 @@ static int do_rtecmd_open(rtemgr_data *d)
 	if (!domain)
 		return -1;
 
-	/* Create new iface which belongs to the domain */
-	iface = iface_new(domain);
-	if (!iface)
-		return -1;
-
-	/* Build iface */
-	if (iface_build(iface, intf->name, intf->path,
-				intf->bus_type, intf->managed)) {
-		iface_free(iface);
-		return -1;
-	}
-	return 0;
+	return iface_open_async(domain, intf->name, intf->path,
+			intf->bus_type, intf->managed, batch);
 }
 
 static int do_rtecmd_close(rtemgr_data *d)
@@ -543,10 +1020,12 @@ static int do_rtecmd_close(rtemgr_data *d)
 		return -1;
 
 	for (i = 0; i < d->nr_intf; i++) {
-		iface = iface_lookup_by_name(
-				domain_lookup_by_id(intf[i].domain),
-				intf[i].name);
-		iface_free(iface);
+		domain = domain_lookup_by_id(intf[i].domain);
+		if ((iface = iface_lookup_by_name(domain, intf[i].name)))
+			iface_free(iface);
+		else if ((iface = iface_lookup_opening(domain, intf[i].name)))
+			/* ctl_job_done() frees it once the worker is done */
+			iface->closing = true;
 	}
 	return 0;
 }
@@ -568,23 +1047,7 @@ static int do_rtecmd_route(rtemgr_data *d)
 	iface_rh = iface_lookup_by_name(domain_lookup_by_id(intf_rh->domain),
 			intf_rh->name);
 
-	if (!iface_lh || !iface_rh || iface_lh == iface_rh)
-		return -1;
-
-	/*
-	 * A raw (non-managed) iface must be bound to a specific one in order
-	 * to route a packet whereas a managed iface does not need to bind to
-	 * any other as it can have a destination in a packet.
-	 */
-	if (!iface_lh->managed) {
-		iface_lh->partner = iface_rh;
-		iface_trigger(iface_lh);
-	}
-	if (!iface_rh->managed) {
-		iface_rh->partner = iface_lh;
-		iface_trigger(iface_rh);
-	}
-	return 0;
+	return iface_route(iface_lh, iface_rh);
 }
 
 static int do_rtecmd_forget(rtemgr_data *d)
@@ -611,12 +1074,7 @@ static int do_rtecmd_cat(rtemgr_data *d)
 	struct evbuffer *buf;
 	char *msg;
 	size_t len;
-	uint8_t *byte_array;
-	struct tm *tm;
-	uint64_t tv_sec, tv_nsec;
-	uint8_t *p_arg, value;
-	char dstr[64];
-	int err, i;
+	int err;
 
 	if (!iface) {
 		fprintf(stderr, "No such interface '%s' is found.\n",
@@ -626,7 +1084,7 @@ static int do_rtecmd_cat(rtemgr_data *d)
 
 	if (iface->partner) {
 		fprintf(stderr, "%s has partner %s, unable to intercept.\n",
-				iface->name, iface->partner);
+				iface->name, iface->partner->name);
 		return -1;
 	}
 
@@ -637,7 +1095,7 @@ static int do_rtecmd_cat(rtemgr_data *d)
 	}
 
 	for (;;) {
-		if (!(err = rteipc_msg_drain(iface->pending, &len, &msg)))
+		if (!(err = pending_pop(&iface->pending, &len, &msg)))
 			break;  /* no more data */
 
 		if (err < 0) {
@@ -645,29 +1103,7 @@ static int do_rtecmd_cat(rtemgr_data *d)
 			goto err;
 		}
 
-		if (iface->bus_type == EP_I2C || iface->bus_type == EP_SPI) {
-			evbuffer_add_printf(buf, "%s", "[");
-			byte_array = (uint8_t *)msg;
-			for (i = 0; i < len; i++) {
-				evbuffer_add_printf(
-					buf, " 0x%02x", byte_array[i]);
-			}
-			evbuffer_add_printf(buf, "%s", " ]\n");
-		} else if (iface->bus_type == EP_GPIO) {
-			p_arg = (uint8_t *)msg;
-			value = *p_arg++;
-			tv_sec = *((uint64_t *)p_arg);
-			p_arg += sizeof(uint64_t);
-			tv_nsec = *((uint64_t *)p_arg);
-			tm = localtime(&tv_sec);
-			strftime(dstr, sizeof(dstr), "%Y-%m-%d %H:%M:%S", tm);
-			evbuffer_add_printf(buf, "[%s.%06lld] %s ==> %s\n",
-					dstr, tv_nsec,
-					!value ? "Hi" : "Lo",
-					value ? "Hi" : "Lo");
-		} else {
-			evbuffer_add_printf(buf, "%.*s\n", len, msg);
-		}
+		rtemgr_data_format(iface->bus_type, msg, len, buf);
 		free(msg);
 	}
 	d->cmd.val.s = evbuffer_get_length(buf);
@@ -686,13 +1122,327 @@ err:
 	return -1;
 }
 
-static void process_ctlport(void *data, size_t len)
+static int make_routes(struct topo_route *routes, int nr_routes)
+{
+	int i, err = 0;
+
+	for (i = 0; i < nr_routes; i++) {
+		if (iface_route(iface_lookup_by_name(&default_domain,
+							routes[i].lh),
+				iface_lookup_by_name(&default_domain,
+							routes[i].rh))) {
+			fprintf(stderr, "Failed to route %s to %s at line %d\n",
+					routes[i].lh, routes[i].rh,
+					routes[i].line);
+			err = -1;
+		}
+	}
+	return err;
+}
+
+/**
+ * Open interfaces and make routes described in a topology, which has an
+ * interface per line in the same columns as 'rtemgr list':
+ *
+ *   NAME  BUS  PATH  [ROUTE]
+ *
+ * ROUTE is the name of the interface to route to, '**' for a managed
+ * interface, or '--' for none. Empty lines and lines starting with '#' are
+ * ignored. All the interfaces are opened before any route is made, so that
+ * ROUTE can refer to an interface in a later line. Interfaces already open
+ * are kept as they are. Everything goes to the default domain, the only
+ * one rtemgrd has.
+ *
+ * If batch is given, endpoints that may block are opened by the control
+ * worker one at a time, in order, and routes are left to the batch.
+ *
+ * Return 0 on success, -1 if any line failed, while the rest is still done.
+ */
+static int load_topology(char *text, struct ctl_batch *batch)
+{
+	struct topo_route *routes = NULL, *tmp;
+	char name[64], bus[16], path[128], route[64];
+	struct interface *iface;
+	int nr_routes = 0, lineno = 0, err = 0;
+	int n, bus_type, managed;
+	char *line;
+
+	while ((line = strsep(&text, "\n"))) {
+		lineno++;
+		line += strspn(line, " \t");
+		if (!*line || *line == '#')
+			continue;
+
+		n = sscanf(line, "%63s %15s %127s %63s", name, bus, path, route);
+		if (n < 3 || strlen(name) >= sizeof(iface->name) ||
+				(n == 4 && strlen(route) >= sizeof(iface->name))) {
+			fprintf(stderr, "Invalid topology at line %d\n", lineno);
+			err = -1;
+			continue;
+		}
+
+		managed = (n == 4 && !strcmp(route, "**"));
+		bus_type = str_to_bus(bus);
+		if (bus_type < 0 || (managed && bus_type != EP_IPC &&
+					bus_type != EP_INET)) {
+			fprintf(stderr, "Invalid bus '%s' at line %d\n",
+					bus, lineno);
+			err = -1;
+			continue;
+		}
+
+		if (iface_lookup_by_name(&default_domain, name)) {
+			fprintf(stderr, "%s is already open, skipped\n", name);
+		} else if (iface_open_async(&default_domain, name, path,
+					bus_type, managed, batch)) {
+			fprintf(stderr, "Failed to open %s at line %d\n",
+					name, lineno);
+			err = -1;
+			continue;
+		}
+
+		if (n < 4 || managed || !strcmp(route, "--"))
+			continue;
+
+		if (!(tmp = realloc(routes, sizeof(*routes) * (nr_routes + 1)))) {
+			fprintf(stderr, "Failed to allocate memory for routes\n");
+			err = -1;
+			break;
+		}
+		routes = tmp;
+		strcpy(routes[nr_routes].lh, name);
+		strcpy(routes[nr_routes].rh, route);
+		routes[nr_routes].line = lineno;
+		nr_routes++;
+	}
+
+	if (batch) {
+		batch->routes = routes;
+		batch->nr_routes = nr_routes;
+		return err;
+	}
+
+	if (make_routes(routes, nr_routes))
+		err = -1;
+	free(routes);
+	return err;
+}
+
+static int do_rtecmd_load(rtemgr_data *d, struct ctl_batch *batch)
+{
+	char *text;
+	int err;
+
+	if (!d->cmd.val.v)
+		return -1;
+
+	/* Topology in val is not null-terminated */
+	if (!(text = malloc(d->cmd.val.s + 1)))
+		return -1;
+	memcpy(text, d->cmd.val.v, d->cmd.val.s);
+	text[d->cmd.val.s] = '\0';
+	err = load_topology(text, batch);
+	free(text);
+
+	/* Don't send the topology back */
+	free(d->cmd.val.v);
+	d->cmd.val.v = NULL;
+	d->cmd.val.s = 0;
+	return err;
+}
+
+static void ctl_session_put(struct ctl_session *s)
+{
+	if (!--s->refs)
+		free(s);
+}
+
+/**
+ * Send a reply to the control session, and free the request.
+ */
+static void ctl_reply(struct ctl_session *s, rtemgr_data *d)
+{
+	/* The client may have gone while the request is in progress */
+	if (!s->bev)
+		goto out;
+
+	/* Emit reply data into buffer and send it to client */
+	if (rtemgr_data_emit(d, out_buf))
+		fprintf(stderr, "Failed to emit data\n");
+	else
+		rteipc_evbuffer(s->bev, out_buf);
+	evbuffer_drain(out_buf, evbuffer_get_length(out_buf));
+out:
+	rtemgr_data_free(d);
+}
+
+/**
+ * Send a managed packet addressed to the control interface to the sessions
+ * that have sent data, each in the format it speaks.
+ */
+static void ctl_send_data(const rtemgr_data *d)
+{
+	struct ctl_session *s;
+	node_t *n;
+	int err;
+
+	list_each(&ctl_sessions, n, {
+		s = list_entry(n, struct ctl_session, node);
+		if (!s->data)
+			continue;
+
+		if (s->binary)
+			err = rtemgr_bin_emit(d, out_buf);
+		else
+			err = rtemgr_data_emit(d, out_buf);
+
+		if (!err)
+			rteipc_evbuffer(s->bev, out_buf);
+		evbuffer_drain(out_buf, evbuffer_get_length(out_buf));
+	})
+}
+
+/**
+ * Drop a reference to batch, and reply once all its jobs are done.
+ */
+static void ctl_batch_put(struct ctl_batch *batch)
+{
+	if (--batch->refs)
+		return;
+
+	if (make_routes(batch->routes, batch->nr_routes))
+		batch->err = -1;
+	batch->req->cmd.error = batch->err;
+	ctl_reply(batch->session, batch->req);
+	ctl_session_put(batch->session);
+	free(batch->routes);
+	free(batch);
+}
+
+/**
+ * Issue a control request that opens interfaces. The reply is sent when
+ * the endpoints opened by the control worker are ready.
+ */
+static void ctl_batch_run(struct ctl_session *s, rtemgr_data *d,
+			int (*action)(rtemgr_data *, struct ctl_batch *))
+{
+	struct ctl_batch *batch;
+
+	if (!(batch = calloc(1, sizeof(*batch)))) {
+		ctl_reply(s, d);
+		return;
+	}
+
+	s->refs++;
+	batch->session = s;
+	batch->req = d;
+	batch->refs = 1;
+	batch->err = action(d, batch);
+	ctl_batch_put(batch);
+}
+
+static void ctl_job_done(evutil_socket_t fd, short what, void *arg)
+{
+	struct ctl_job_queue done;
+	struct interface *iface;
+	struct ctl_job *job;
+
+	pthread_mutex_lock(&ctl_worker.lock);
+	done = ctl_worker.done;
+	ctl_worker.done.head = ctl_worker.done.tail = NULL;
+	pthread_mutex_unlock(&ctl_worker.lock);
+
+	while ((job = ctl_job_pop(&done))) {
+		iface = job->iface;
+		iface->ep = job->ep;
+		iface->opening = false;
+		if (iface->closing) {
+			fprintf(stderr, "%s closed while opening\n",
+					iface->name);
+			iface_free(iface);
+			job->batch->err = -1;
+		} else if (iface_attach(iface)) {
+			fprintf(stderr, "Failed to open %s\n", iface->name);
+			iface_free(iface);
+			job->batch->err = -1;
+		}
+		ctl_batch_put(job->batch);
+		free(job);
+	}
+}
+
+static void *ctl_worker_main(void *arg)
+{
+	struct ctl_job *job;
+
+	/* Events of endpoints opened here go to the base of the event loop */
+	rteipc_init(arg);
+
+	pthread_mutex_lock(&ctl_worker.lock);
+	for (;;) {
+		while (!(job = ctl_job_pop(&ctl_worker.todo)))
+			pthread_cond_wait(&ctl_worker.cond, &ctl_worker.lock);
+		pthread_mutex_unlock(&ctl_worker.lock);
+
+		if (job->op == CTL_JOB_OPEN)
+			job->ep = rteipc_open(job->uri);
+		else
+			rteipc_close(job->ep);
+
+		pthread_mutex_lock(&ctl_worker.lock);
+		if (job->op == CTL_JOB_OPEN) {
+			ctl_job_push(&ctl_worker.done, job);
+			event_active(ctl_worker.done_ev, EV_READ, 0);
+		} else {
+			free(job);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Start the control worker. If it fails, endpoints are opened and closed on
+ * the event loop as before.
+ */
+static void ctl_worker_start(struct event_base *base)
+{
+	ctl_worker.done_ev = event_new(base, -1, 0, ctl_job_done, NULL);
+	if (!ctl_worker.done_ev)
+		goto error;
+
+	if (pthread_create(&ctl_worker.thread, NULL, ctl_worker_main, base)) {
+		event_free(ctl_worker.done_ev);
+		goto error;
+	}
+	ctl_worker.running = true;
+	return;
+error:
+	fprintf(stderr, "Failed to start control worker\n");
+}
+
+/**
+ * Let the managed iface callback handle data sent by a session through the
+ * control interface. The session receives data to the control interface in
+ * the same format from now on.
+ */
+static void ctl_session_data(struct ctl_session *s, void *data, size_t len)
+{
+	iface_managed_handler(ctrl_iface, data, len);
+	s->binary = ctrl_iface->binary;
+	s->data = true;
+}
+
+static void process_ctlport(struct ctl_session *s, void *data, size_t len)
 {
 	rtemgr_data *d;
-	unsigned char buf[4096] = {0};
-	size_t written;
 	int (*action)(rtemgr_data *) = NULL;
 
+	/* Data to a managed interface in binary format, no reply */
+	if (rtemgr_bin_match(data, len)) {
+		ctl_session_data(s, data, len);
+		return;
+	}
+
 	if (!(d = rtemgr_data_parse(data, len)))
 		return;
 
@@ -702,8 +1452,8 @@ static void process_ctlport(void *data, size_t len)
 		action = do_rtecmd_list;
 		break;
 	case RTECMD_OPEN:
-		action = do_rtecmd_open;
-		break;
+		ctl_batch_run(s, d, do_rtecmd_open);
+		return;
 	case RTECMD_CLOSE:
 		action = do_rtecmd_close;
 		break;
@@ -715,56 +1465,216 @@ static void process_ctlport(void *data, size_t len)
 		break;
 	case RTECMD_XFER:
 		/* Let managed iface callback handle it */
-		iface_managed_handler(ctrl_iface, data, len);
+		ctl_session_data(s, data, len);
 		//FIXME
 		d->cmd.error = 0;
 		break;
 	case RTECMD_CAT:
 		action = do_rtecmd_cat;
 		break;
+	case RTECMD_LOAD:
+		ctl_batch_run(s, d, do_rtecmd_load);
+		return;
 	}
 
 	if (action)
 		d->cmd.error = action(d);
 
-	/* Emit reply data into buffer */
-	if (rtemgr_data_emit(d, buf, sizeof(buf), &written)) {
-		fprintf(stderr, "Failed to emit data\n");
-		goto out;
+	ctl_reply(s, d);
+}
+
+static void ctl_read_cb(struct bufferevent *bev, void *arg)
+{
+	struct ctl_session *s = arg;
+	struct evbuffer *in = bufferevent_get_input(bev);
+	char *msg;
+	size_t len;
+
+	while (rteipc_msg_drain(in, &len, &msg) > 0) {
+		process_ctlport(s, msg, len);
+		free(msg);
 	}
+}
 
-	/* Send reply to client */
-	rteipc_xfer(RTEMGRD_CTLPORT, buf, written);
-out:
+static void ctl_event_cb(struct bufferevent *bev, short events, void *arg)
+{
+	struct ctl_session *s = arg;
+
+	if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+		list_remove(&ctl_sessions, &s->node);
+		bufferevent_free(s->bev);
+		s->bev = NULL;
+		ctl_session_put(s);
+	}
+}
+
+static void ctl_accept_cb(struct evconnlistener *el, evutil_socket_t fd,
+			struct sockaddr *sa, int socklen, void *arg)
+{
+	struct event_base *base = evconnlistener_get_base(el);
+	struct ctl_session *s;
+
+	if (!(s = calloc(1, sizeof(*s)))) {
+		evutil_closesocket(fd);
+		return;
+	}
+
+	s->bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+	if (!s->bev) {
+		fprintf(stderr, "Failed to accept a control client\n");
+		evutil_closesocket(fd);
+		free(s);
+		return;
+	}
+	s->refs = 1;
+	list_push(&ctl_sessions, &s->node);
+	bufferevent_setcb(s->bev, ctl_read_cb, NULL, ctl_event_cb, s);
+	bufferevent_enable(s->bev, EV_READ);
+}
+
+static int do_rtecmd_follow(rtemgr_data *d, struct follower *f)
+{
+	struct interface *iface;
+
+	if (d->cmd.action != RTECMD_FOLLOW || !d->interfaces)
+		return -1;
+
+	iface = iface_lookup_by_name(domain_lookup_by_id(d->interfaces->domain),
+			d->interfaces->name);
+	if (!iface) {
+		fprintf(stderr, "No such interface '%s' is found.\n",
+				d->interfaces->name);
+		return -1;
+	}
+
+	if (iface->managed) {
+		fprintf(stderr, "%s is a managed interface, unable to follow.\n",
+				iface->name);
+		return -1;
+	}
+
+	f->iface = iface;
+	list_push(&iface->followers, &f->node);
+	/* Tell the follower how to read data */
+	iface_set_sender(d->interfaces, iface);
+	return 0;
+}
+
+static void follow_read_cb(struct bufferevent *bev, void *arg)
+{
+	struct follower *f = arg;
+	struct evbuffer *in = bufferevent_get_input(bev);
+	rtemgr_data *d;
+	char *msg;
+	size_t len;
+	int err;
+
+	/* Nothing is expected from a follower after the request */
+	if (f->iface) {
+		evbuffer_drain(in, evbuffer_get_length(in));
+		return;
+	}
+
+	if (!(err = rteipc_msg_drain(in, &len, &msg)))
+		return;  /* wait for the rest of the request */
+
+	if (err < 0 || !(d = rtemgr_data_parse((unsigned char *)msg, len))) {
+		if (err > 0)
+			free(msg);
+		follow_free(f);
+		return;
+	}
+	free(msg);
+
+	d->cmd.error = do_rtecmd_follow(d, f);
+
+	/* Reply in YAML, which is followed by data in binary format */
+	if (rtemgr_data_emit(d, out_buf))
+		fprintf(stderr, "Failed to emit data\n");
+	else
+		rteipc_evbuffer(bev, out_buf);
+	evbuffer_drain(out_buf, evbuffer_get_length(out_buf));
 	rtemgr_data_free(d);
 }
 
+static void follow_event_cb(struct bufferevent *bev, short events, void *arg)
+{
+	if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+		follow_free(arg);
+}
+
+static void follow_accept_cb(struct evconnlistener *el, evutil_socket_t fd,
+			struct sockaddr *sa, int socklen, void *arg)
+{
+	struct event_base *base = evconnlistener_get_base(el);
+	struct follower *f;
+
+	if (!(f = calloc(1, sizeof(*f)))) {
+		evutil_closesocket(fd);
+		return;
+	}
+
+	f->bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+	if (!f->bev) {
+		fprintf(stderr, "Failed to accept a follower\n");
+		evutil_closesocket(fd);
+		free(f);
+		return;
+	}
+	bufferevent_setcb(f->bev, follow_read_cb, NULL, follow_event_cb, f);
+	bufferevent_enable(f->bev, EV_READ);
+}
+
+/**
+ * Listen on a port in the abstract namespace (i.e. '@' prefixed), where any
+ * number of clients can connect.
+ */
+static struct evconnlistener *listen_port(struct event_base *base,
+			const char *port, evconnlistener_cb cb)
+{
+	struct sockaddr_un sun;
+	int addrlen;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, port, sizeof(sun.sun_path) - 1);
+	/* Abstract namespace, no null-terminator */
+	sun.sun_path[0] = 0;
+	addrlen = offsetof(struct sockaddr_un, sun_path) + strlen(port);
+
+	return evconnlistener_new_bind(base, cb, NULL,
+			LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE, -1,
+			(struct sockaddr *)&sun, addrlen);
+}
+
 /**
  * Callback to handle data from a backend device behind an interface.
- * An interface-level callback is subsequently invoked except for the control
- * interface that is special.
+ * An interface-level callback is subsequently invoked. The control interface
+ * has no backend, clients connect to rtemgrd directly (see ctl_session).
  */
 static void
 default_domain_handler(const char *name, void *data, size_t len, void *arg)
 {
 	struct interface *iface = arg;
 
-	if (strmatch(name, RTEMGRD_CTLPORT)) {
-		/* For the control interface */
-		process_ctlport(data, len);
-	} else {
-		/* Invoke an interface-level callback */
-		if (iface && iface->handler)
-			iface->handler(iface, data, len);
+	/* Invoke an interface-level callback */
+	if (iface && iface->handler) {
+		follow_publish(iface, data, len);
+		iface->handler(iface, data, len);
 	}
 }
 
 static void rtemgrd(void)
 {
-	/* Initialize rteipc */
-	rteipc_init(NULL);
+	struct event_base *base;
+
+	/* Initialize rteipc, the base is shared with the control worker */
+	if (evthread_use_pthreads() || !(base = event_base_new()))
+		goto error;
+	rteipc_init(base);
 
 	list_push(&domain_list, &default_domain.node);
+	domain_hash_add(&default_domain);
 
 	/**
 	 * Create and setup '@rtemgrd' control iface to which client
@@ -774,12 +1684,38 @@ static void rtemgrd(void)
 	if (!ctrl_iface)
 		goto error;
 
+	out_buf = evbuffer_new();
+	if (!out_buf)
+		goto error;
+
 	/**
-	 * Build control iface.
+	 * Build control iface. It is looked up as a managed iface, but
+	 * rtemgrd listens on the port by itself instead of an IPC endpoint,
+	 * which accepts only one client.
 	 */
-	if (iface_build(ctrl_iface, RTEMGRD_CTLPORT, RTEMGRD_CTLPORT,
-				EP_IPC, 1))
+	iface_setup(ctrl_iface, RTEMGRD_CTLPORT, RTEMGRD_CTLPORT, EP_IPC, 1);
+	if (ctrl_iface->id < 0 ||
+			!listen_port(base, RTEMGRD_CTLPORT, ctl_accept_cb))
 		goto error;
+	iface_hash_add(ctrl_iface);
+
+	/**
+	 * Listen for followers of interfaces.
+	 */
+	if (!listen_port(base, RTEMGRD_FOLLOWPORT, follow_accept_cb))
+		goto error;
+
+	ctl_worker_start(base);
+
+	/**
+	 * Bring up interfaces in the topology file.
+	 */
+	if (topology) {
+		if (load_topology(topology, NULL))
+			fprintf(stderr, "Failed to load some of topology\n");
+		free(topology);
+		topology = NULL;
+	}
 
 	/**
 	 * Run event loop
@@ -793,9 +1729,94 @@ error:
 
 static void usage(void)
 {
-	fprintf(stderr, "usage: rtemgrd [-B]\n"
+	fprintf(stderr, "usage: rtemgrd [-B] [-f file] [-p opt[,opt...]]\n"
 			"options:\n"
-			"   -B   run daemon in the background\n");
+			"   -B   run daemon in the background\n"
+			"   -f   open interfaces and routes in the topology file\n"
+			"   -p   limits of pending queues of unrouted interfaces\n"
+			"     max_bytes=bytes   Data kept in memory (default 1MiB,\n"
+			"                       0 for no limit)\n"
+			"     max_msgs=number   Messages kept in memory (default no limit)\n"
+			"     drop=old|new      Drop the oldest or the new message when\n"
+			"                       full (default old)\n"
+			"     spill=dir         Put data over the limits into a file in dir\n"
+			"     spill_size=bytes  Size of the file for each interface\n"
+			"                       (default 16MiB)\n");
+}
+
+/**
+ * Read whole the file into a null-terminated string, which must be free()ed
+ * by caller.
+ */
+static char *read_file(const char *path)
+{
+	struct evbuffer *buf;
+	char *text = NULL;
+	size_t len;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		fprintf(stderr, "Failed to open %s\n", path);
+		return NULL;
+	}
+
+	if (!(buf = evbuffer_new()))
+		goto out;
+
+	while (evbuffer_read(buf, fd, -1) > 0)
+		;
+
+	len = evbuffer_get_length(buf);
+	if ((text = malloc(len + 1))) {
+		evbuffer_remove(buf, text, len);
+		text[len] = '\0';
+	}
+	evbuffer_free(buf);
+out:
+	close(fd);
+	return text;
+}
+
+static int parse_pending_opts(char *opts)
+{
+	char *key, *val, *save;
+
+	for (key = strtok_r(opts, ",", &save); key;
+			key = strtok_r(NULL, ",", &save)) {
+		if ((val = strchr(key, '=')))
+			*val++ = '\0';
+
+		if (!val) {
+			fprintf(stderr, "Invalid pending option:%s\n", key);
+			return -1;
+		} else if (!strcmp(key, "max_bytes")) {
+			pending_conf.max_bytes = strtoul(val, NULL, 0);
+		} else if (!strcmp(key, "max_msgs")) {
+			pending_conf.max_msgs = strtoul(val, NULL, 0);
+		} else if (!strcmp(key, "drop") && !strcmp(val, "old")) {
+			pending_conf.drop_new = false;
+		} else if (!strcmp(key, "drop") && !strcmp(val, "new")) {
+			pending_conf.drop_new = true;
+		} else if (!strcmp(key, "spill")) {
+			/* Absolute path as daemon() changes directory */
+			if (!(pending_conf.spill_dir = realpath(val, NULL))) {
+				fprintf(stderr, "Invalid spill directory:%s\n",
+						val);
+				return -1;
+			}
+		} else if (!strcmp(key, "spill_size")) {
+			pending_conf.spill_size = strtoul(val, NULL, 0);
+		} else {
+			fprintf(stderr, "Invalid pending option:%s\n", key);
+			return -1;
+		}
+	}
+
+	if (pending_conf.spill_dir && !pending_conf.spill_size) {
+		fprintf(stderr, "spill_size must not be 0\n");
+		return -1;
+	}
+	return 0;
 }
 
 int main(int argc, char **argv)
@@ -804,7 +1825,7 @@ int main(int argc, char **argv)
 	int c;
 
 	while (1) {
-		c = getopt(argc, argv, "B");
+		c = getopt(argc, argv, "Bf:p:");
 		if (c < 0)
 			break;
 
@@ -812,6 +1833,18 @@ int main(int argc, char **argv)
 		case 'B':
 			daemonize++;
 			break;
+		case 'f':
+			/* Read it now as daemon() changes directory */
+			free(topology);
+			if (!(topology = read_file(optarg)))
+				exit(1);
+			break;
+		case 'p':
+			if (parse_pending_opts(optarg)) {
+				usage();
+				exit(1);
+			}
+			break;
 		default:
 			usage();
 			exit(1);
@@ -0,0 +1,433 @@
+// Copyright (c) 2021 Ryosuke Saito All rights reserved.
+// MIT licensed
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include "shm.h"
+
+
+/* Space reserved for a ring header */
+#define SHM_HDR_SIZE		256
+#define SHM_RING_SIZE_MIN	4096
+
+/* Length marking the rest of the ring is skipped */
+#define SHM_WRAP		0xffffffffu
+
+#define ALIGN4(n)		(((n) + 3) & ~3u)
+
+struct shm_ring_hdr {
+	_Atomic uint32_t head;    /* written by the producer */
+	uint8_t pad0[60];
+	_Atomic uint32_t tail;    /* written by the consumer */
+	uint8_t pad1[60];
+	_Atomic uint32_t waiting; /* the consumer waits for data */
+	_Atomic uint32_t full;    /* the producer waits for space */
+	uint32_t size;
+};
+
+static inline void wake(int efd)
+{
+	eventfd_write(efd, 1);
+}
+
+static void ring_init(struct shm_ring *r, void *base, uint32_t size)
+{
+	r->hdr = base;
+	r->data = (uint8_t *)base + SHM_HDR_SIZE;
+	r->size = size;
+}
+
+/**
+ * Reserve space for a message of @len bytes and return where data is to be
+ * stored, or NULL if the ring is full.
+ */
+static void *ring_reserve(struct shm_ring *r, uint32_t len)
+{
+	uint32_t head = atomic_load_explicit(&r->hdr->head,
+					     memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(&r->hdr->tail,
+					     memory_order_acquire);
+	uint32_t need = 4 + ALIGN4(len);
+	uint32_t idx = head & (r->size - 1);
+	uint32_t skip = (r->size - idx < need) ? r->size - idx : 0;
+
+	if (r->size - (head - tail) < skip + need)
+		return NULL;
+
+	if (skip) {
+		*(uint32_t *)(r->data + idx) = SHM_WRAP;
+		head += skip;
+		idx = 0;
+	}
+
+	*(uint32_t *)(r->data + idx) = len;
+	r->next = head + need;
+	return r->data + idx + 4;
+}
+
+static void *chan_reserve(struct shm_chan *ch, uint32_t len)
+{
+	struct shm_ring *r = &ch->tx;
+	void *p;
+
+	if ((p = ring_reserve(r, len)))
+		return p;
+
+	/*
+	 * Ask the peer to wake us up on release, then try again in case it
+	 * has released before seeing the flag.
+	 */
+	atomic_store(&r->hdr->full, 1);
+	if ((p = ring_reserve(r, len)))
+		atomic_store(&r->hdr->full, 0);
+	return p;
+}
+
+static void chan_commit(struct shm_chan *ch)
+{
+	struct shm_ring *r = &ch->tx;
+
+	atomic_store_explicit(&r->hdr->head, r->next, memory_order_release);
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_exchange(&r->hdr->waiting, 0))
+		wake(ch->peer_efd);
+}
+
+static int chan_map(struct shm_chan *ch, uint32_t size)
+{
+	ch->map_size = 2 * (SHM_HDR_SIZE + (size_t)size);
+	ch->map = mmap(NULL, ch->map_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED, ch->memfd, 0);
+	if (ch->map == MAP_FAILED) {
+		ch->map = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * shm_chan_create - create a channel with two rings of @ring_size bytes
+ * @ch: channel to be initialized
+ * @ring_size: size of a ring, rounded up to a power of two
+ *
+ * Return 0 on success, otherwise -1.
+ */
+int shm_chan_create(struct shm_chan *ch, size_t ring_size)
+{
+	uint32_t size = SHM_RING_SIZE_MIN;
+	struct shm_ring_hdr *hdr;
+
+	while (size < ring_size && size < (1u << 30))
+		size <<= 1;
+
+	memset(ch, 0, sizeof(*ch));
+	ch->efd = ch->peer_efd = -1;
+
+	ch->memfd = memfd_create("rteipc-shm", MFD_CLOEXEC);
+	if (ch->memfd < 0) {
+		fprintf(stderr, "Failed to create memfd(%d)\n", errno);
+		return -1;
+	}
+
+	if (ftruncate(ch->memfd, 2 * (SHM_HDR_SIZE + (off_t)size)) ||
+			chan_map(ch, size)) {
+		fprintf(stderr, "Failed to map shm ring(%d)\n", errno);
+		goto err;
+	}
+
+	ring_init(&ch->tx, ch->map, size);
+	ring_init(&ch->rx, (uint8_t *)ch->map + SHM_HDR_SIZE + size, size);
+	hdr = ch->tx.hdr;
+	hdr->size = size;
+	hdr = ch->rx.hdr;
+	hdr->size = size;
+
+	ch->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	ch->peer_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ch->efd < 0 || ch->peer_efd < 0) {
+		fprintf(stderr, "Failed to create eventfd(%d)\n", errno);
+		goto err;
+	}
+	return 0;
+
+err:
+	shm_chan_destroy(ch);
+	return -1;
+}
+
+/**
+ * shm_chan_attach - set up a channel with fds received from the creator
+ * @ch: channel to be initialized
+ * @memfd: memfd of the rings
+ * @efd: eventfd to be woken up by the peer
+ * @peer_efd: eventfd to wake the peer up
+ *
+ * The rings are swapped so that the tx of the creator is the rx of ours.
+ * Return 0 on success, otherwise -1.
+ */
+int shm_chan_attach(struct shm_chan *ch, int memfd, int efd, int peer_efd)
+{
+	struct shm_ring_hdr *hdr;
+	struct stat st;
+	size_t size;
+
+	memset(ch, 0, sizeof(*ch));
+	ch->memfd = memfd;
+	ch->efd = efd;
+	ch->peer_efd = peer_efd;
+
+	if (fstat(memfd, &st) || st.st_size <= 2 * SHM_HDR_SIZE)
+		goto err;
+
+	size = st.st_size / 2 - SHM_HDR_SIZE;
+	if (size < SHM_RING_SIZE_MIN || (size & (size - 1)) ||
+			chan_map(ch, size))
+		goto err;
+
+	hdr = ch->map;
+	if (hdr->size != size)
+		goto err;
+
+	ring_init(&ch->rx, ch->map, size);
+	ring_init(&ch->tx, (uint8_t *)ch->map + SHM_HDR_SIZE + size, size);
+	return 0;
+
+err:
+	fprintf(stderr, "Invalid shm ring\n");
+	shm_chan_destroy(ch);
+	return -1;
+}
+
+void shm_chan_destroy(struct shm_chan *ch)
+{
+	if (ch->map)
+		munmap(ch->map, ch->map_size);
+	if (ch->memfd >= 0)
+		close(ch->memfd);
+	if (ch->efd >= 0)
+		close(ch->efd);
+	if (ch->peer_efd >= 0)
+		close(ch->peer_efd);
+	memset(ch, 0, sizeof(*ch));
+	ch->memfd = ch->efd = ch->peer_efd = -1;
+}
+
+/* A message must fit in the half of a ring wherever it starts */
+static inline bool msg_fits(struct shm_chan *ch, size_t len)
+{
+	return 4 + ALIGN4(len) <= ch->tx.size / 2;
+}
+
+/**
+ * shm_chan_send - copy a message into the tx ring
+ * @ch: channel
+ * @data: message data
+ * @len: length of data
+ *
+ * Return 1 on success, 0 if the ring is full, otherwise -1 on error. The
+ * peer wakes us up when it has made space after 0 returned.
+ */
+int shm_chan_send(struct shm_chan *ch, const void *data, size_t len)
+{
+	void *p;
+
+	if (!msg_fits(ch, len))
+		return -1;
+
+	if (!(p = chan_reserve(ch, len)))
+		return 0;
+
+	memcpy(p, data, len);
+	chan_commit(ch);
+	return 1;
+}
+
+/**
+ * shm_chan_send_msg - move a message framed by rteipc_evbuffer() from an
+ *                     evbuffer into the tx ring
+ * @ch: channel
+ * @buf: evbuffer from which a message removed
+ *
+ * Return 1 on success, 0 if no complete message in @buf or the ring is full,
+ * otherwise -1 if the message is too long and discarded.
+ */
+int shm_chan_send_msg(struct shm_chan *ch, struct evbuffer *buf)
+{
+	size_t buflen = evbuffer_get_length(buf);
+	uint32_t len;
+	void *p;
+
+	if (buflen < 4)
+		return 0;
+
+	evbuffer_copyout(buf, &len, 4);
+	len = ntohl(len);
+	if (buflen < 4 + (size_t)len)
+		return 0;
+
+	if (!msg_fits(ch, len)) {
+		evbuffer_drain(buf, 4 + (size_t)len);
+		return -1;
+	}
+
+	if (!(p = chan_reserve(ch, len)))
+		return 0;
+
+	evbuffer_drain(buf, 4);
+	evbuffer_remove(buf, p, len);
+	chan_commit(ch);
+	return 1;
+}
+
+/**
+ * shm_chan_recv - get the next message in the rx ring in place
+ * @ch: channel
+ * @data_out: pointer to message data in the ring
+ * @size_out: length of data
+ *
+ * The message stays valid until shm_chan_release() is called.
+ * Return 1 on success, 0 if the ring is empty, otherwise -1 if the ring is
+ * corrupted.
+ */
+int shm_chan_recv(struct shm_chan *ch, void **data_out, size_t *size_out)
+{
+	struct shm_ring *r = &ch->rx;
+	uint32_t tail = atomic_load_explicit(&r->hdr->tail,
+					     memory_order_relaxed);
+	uint32_t head = atomic_load_explicit(&r->hdr->head,
+					     memory_order_acquire);
+	uint32_t idx, len;
+
+	if (tail == head)
+		return 0;
+
+	idx = tail & (r->size - 1);
+	len = *(uint32_t *)(r->data + idx);
+	if (len == SHM_WRAP) {
+		tail += r->size - idx;
+		idx = 0;
+		len = *(uint32_t *)r->data;
+	}
+
+	if (head - tail < 4 + ALIGN4(len) || idx + 4 + ALIGN4(len) > r->size)
+		return -1;
+
+	*data_out = r->data + idx + 4;
+	*size_out = len;
+	r->next = tail + 4 + ALIGN4(len);
+	return 1;
+}
+
+/**
+ * shm_chan_release - give back the space of the message got by
+ *                    shm_chan_recv() to the peer
+ * @ch: channel
+ */
+void shm_chan_release(struct shm_chan *ch)
+{
+	struct shm_ring *r = &ch->rx;
+
+	atomic_store_explicit(&r->hdr->tail, r->next, memory_order_release);
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_exchange(&r->hdr->full, 0))
+		wake(ch->peer_efd);
+}
+
+/**
+ * shm_chan_idle - ask the peer to wake us up on the next message
+ * @ch: channel
+ *
+ * Return true if the rx ring is empty and it's ok to wait for efd, false if a
+ * message has arrived in the meantime and must be received first.
+ */
+bool shm_chan_idle(struct shm_chan *ch)
+{
+	struct shm_ring *r = &ch->rx;
+
+	atomic_store(&r->hdr->waiting, 1);
+	if (atomic_load(&r->hdr->head) == atomic_load(&r->hdr->tail))
+		return true;
+
+	atomic_store(&r->hdr->waiting, 0);
+	return false;
+}
+
+/**
+ * shm_chan_send_fds - pass the fds of a channel to the peer
+ * @ch: channel created by shm_chan_create()
+ * @sock: connected Unix domain socket
+ */
+int shm_chan_send_fds(struct shm_chan *ch, int sock)
+{
+	int fds[3] = { ch->memfd, ch->peer_efd, ch->efd };
+	char cbuf[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov = { .iov_base = "S", .iov_len = 1 };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	ssize_t ret;
+
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	do {
+		ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	} while (ret < 0 && errno == EINTR);
+
+	return (ret == 1) ? 0 : -1;
+}
+
+/**
+ * shm_chan_recv_fds - receive the fds of a channel and attach to it
+ * @ch: channel to be initialized
+ * @sock: connected Unix domain socket
+ *
+ * Return 0 on success, 1 if nothing received yet, otherwise -1.
+ */
+int shm_chan_recv_fds(struct shm_chan *ch, int sock)
+{
+	int fds[3];
+	char cbuf[CMSG_SPACE(sizeof(fds))], c;
+	struct iovec iov = { .iov_base = &c, .iov_len = 1 };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg;
+	ssize_t ret;
+
+	do {
+		ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 1;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (ret != 1 || !cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+			cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+		fprintf(stderr, "Failed to receive shm channel\n");
+		return -1;
+	}
+
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	return shm_chan_attach(ch, fds[0], fds[1], fds[2]);
+}
@@ -0,0 +1,75 @@
+// Copyright (c) 2021 Ryosuke Saito All rights reserved.
+// MIT licensed
+
+/*
+ * A shm channel is a pair of single-producer single-consumer ring buffers in
+ * one memfd shared by two processes, one ring for each direction, and an
+ * eventfd for each side to be woken up. The memfd and eventfds are created by
+ * the SHM endpoint and passed to the connecting process over a Unix domain
+ * socket with SCM_RIGHTS.
+ *
+ *       SHM endpoint                                process
+ *    +---------------+          memfd           +---------------+
+ *    |      .tx -----|--> [ ring 0 ] -----------|---> .rx       |
+ *    |      .rx <----|--- [ ring 1 ] <----------|---- .tx       |
+ *    |               |                          |               |
+ *    |      .efd <---|------- eventfd 0 --------|---- .peer_efd |
+ *    | .peer_efd ----|------- eventfd 1 --------|---> .efd      |
+ *    +---------------+                          +---------------+
+ *
+ * A message is stored in a ring as a 4-byte length followed by data, padded
+ * to 4 bytes and never wrapped around, so that the consumer can pass it to
+ * the user in place. The peer is woken up only when it is waiting for data or
+ * space, a stream of messages costs no syscall.
+ */
+#ifndef _RTEIPC_SHM_H
+#define _RTEIPC_SHM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <event2/buffer.h>
+
+/* Default size of a ring */
+#define SHM_RING_SIZE_DEFAULT	(1 << 20)
+
+struct shm_ring_hdr;
+
+struct shm_ring {
+	struct shm_ring_hdr *hdr;
+	uint8_t *data;
+	uint32_t size;        /* power of two */
+	uint32_t next;        /* position to be published */
+};
+
+struct shm_chan {
+	void *map;
+	size_t map_size;
+	struct shm_ring tx;
+	struct shm_ring rx;
+	int memfd;
+	int efd;              /* woken up by the peer */
+	int peer_efd;         /* wakes the peer up */
+};
+
+int shm_chan_create(struct shm_chan *ch, size_t ring_size);
+
+int shm_chan_attach(struct shm_chan *ch, int memfd, int efd, int peer_efd);
+
+void shm_chan_destroy(struct shm_chan *ch);
+
+int shm_chan_send(struct shm_chan *ch, const void *data, size_t len);
+
+int shm_chan_send_msg(struct shm_chan *ch, struct evbuffer *buf);
+
+int shm_chan_recv(struct shm_chan *ch, void **data_out, size_t *size_out);
+
+void shm_chan_release(struct shm_chan *ch);
+
+bool shm_chan_idle(struct shm_chan *ch);
+
+int shm_chan_send_fds(struct shm_chan *ch, int sock);
+
+int shm_chan_recv_fds(struct shm_chan *ch, int sock);
+
+#endif /* _RTEIPC_SHM_H */
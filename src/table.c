@@ -113,12 +113,25 @@ out:
 
 void dtbl_del(dtbl_t *table, int id)
 {
+	dtbl_entry_t *e;
+	node_t *n;
+
 	if (table) {
 		pthread_mutex_lock(&table->lock);
 
 		if ((id / DESC_BIT_WIDTH) < table->max_entries)
 			__clear_desc_id(table->desc, id);
 
+		/* Drop the entry, or dtbl_get() finds it once id is reused */
+		for (n = table->entry_list.head; n; n = n->next) {
+			e = list_entry(n, dtbl_entry_t, node);
+			if (e->id == id) {
+				list_remove(&table->entry_list, n);
+				free(e);
+				break;
+			}
+		}
+
 		pthread_mutex_unlock(&table->lock);
 	}
 }